@@ -0,0 +1,132 @@
+#define IMPLEMENT_ZEPHYR_H
+#define IMPLEMENT_SCHEMA_H
+#include "test-cpp-compact.h"
+
+#include <stdio.h>
+#include <vector>
+
+// Same runner as test.cpp, for the classes generated with --cpp-compact
+#define check(condition) \
+  do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+static int failures = 0;
+
+static void it(const char *name, bool (*test)()) {
+  bool ok = test();
+  printf("%s %s\n", ok ? "ok" : "not ok", name);
+  if (!ok) failures++;
+}
+
+static void buildOrder(test_cpp::Order &order, zephyr::MemoryPool &pool) {
+  order.set_id(0x123456789ULL);
+  order.set_note(pool.string("note"));
+  order.set_payload(pool, 3).set({1, 2, 250});
+  order.set_kind(test_cpp::Kind::LARGE);
+
+  test_cpp::Point origin;
+  origin.set_x(1.5f);
+  origin.set_y(-2);
+  order.set_origin(origin);
+
+  zephyr::CompactArray<test_cpp::Item> &items = order.set_items(pool, 2);
+  items[0].set_sku(pool.string("apple"));
+  items[0].set_count(3);
+  zephyr::CompactArray<zephyr::String> &tags = items[0].set_tags(pool, 2);
+  tags[0] = pool.string("red");
+  tags[1] = pool.string("fresh");
+  items[1].set_sku(pool.string("pear"));
+
+  zephyr::CompactArray<int32_t> &values = order.set_values(pool, 3);
+  values.set({-1, 0, 1000000});
+
+  test_cpp::Item *gift = pool.allocate<test_cpp::Item>();
+  gift->set_sku(pool.string("card"));
+  order.set_gift(gift);
+}
+
+int main() {
+  it("compact classes round-trip", [] {
+    zephyr::ArenaAllocator arena(1 << 20);
+    zephyr::MemoryPool pool(arena, 1 << 12);
+
+    test_cpp::Order *order = pool.allocate<test_cpp::Order>();
+    buildOrder(*order, pool);
+    zephyr::ByteBuffer bb;
+    check(order->encode(bb));
+
+    test_cpp::Order *decoded = pool.allocate<test_cpp::Order>();
+    zephyr::ByteBuffer in(bb.data(), bb.size());
+    check(decoded->decode(in, pool));
+    check(*decoded->id() == 0x123456789ULL);
+    check(*decoded->kind() == test_cpp::Kind::LARGE);
+    check(*decoded->origin()->x() == 1.5f && *decoded->origin()->y() == -2);
+    check(decoded->items()->size() == 2);
+    check(!strcmp((*decoded->items())[0].sku()->c_str(), "apple"));
+    check(!strcmp((*(*decoded->items())[0].tags())[1].c_str(), "fresh"));
+    check(!(*decoded->items())[1].tags());
+    check((*decoded->values())[2] == 1000000);
+    check(!strcmp(decoded->gift()->sku()->c_str(), "card"));
+    check(decoded->payload()->size() == 3 && (*decoded->payload())[2] == 250);
+
+    zephyr::ByteBuffer again;
+    check(decoded->encode(again));
+    check(again.size() == bb.size() && !memcmp(again.data(), bb.data(), bb.size()));
+
+    // Deprecated fields are read past, inline structs included
+    test_cpp::LegacyOrder *legacy = pool.allocate<test_cpp::LegacyOrder>();
+    zephyr::ByteBuffer legacyIn(bb.data(), bb.size());
+    check(legacy->decode(legacyIn, pool) && legacyIn.index() == bb.size());
+    check(*legacy->id() == 0x123456789ULL);
+
+    for (size_t size = 0; size < bb.size(); size++) {
+      test_cpp::Order *truncated = pool.allocate<test_cpp::Order>();
+      zephyr::ByteBuffer part(bb.data(), size);
+      check(!truncated->decode(part, pool));
+    }
+    return true;
+  });
+
+  it("compact arrays report elements out of reach", [] {
+    if (sizeof(void *) < 8) return true;
+    int32_t value = 0;
+    zephyr::CompactArray<int32_t> array;
+    int32_t *far = reinterpret_cast<int32_t *>(reinterpret_cast<uintptr_t>(&array) + (uint64_t(1) << 33));
+    check(!array.assign(far, 1));
+    check(array.size() == 0 && array.data() == nullptr);
+    check(array.assign(&value, 1) && array.data() == &value);
+    check(array.assign(nullptr, 0) && array.size() == 0);
+    return true;
+  });
+
+  it("decoding again drops the previous unknown fields", [] {
+    std::vector<uint8_t> bytes;
+    FILE *file = fopen("test-cpp-v2.bzephyr", "rb");
+    check(file);
+    for (int c; (c = fgetc(file)) != EOF;) bytes.push_back(static_cast<uint8_t>(c));
+    fclose(file);
+    test_cpp::BinarySchema schema;
+    zephyr::ByteBuffer schemaIn(bytes.data(), bytes.size());
+    check(schema.parse(schemaIn));
+
+    // Order with an id and a comment, which only the v2 schema knows about
+    zephyr::ByteBuffer bb;
+    bb.writeVarUint(1);
+    bb.writeVarUint64(7);
+    bb.writeVarUint(9);
+    bb.writeString("v2");
+    bb.writeVarUint(0);
+
+    zephyr::MemoryPool pool;
+    test_cpp::Order *order = pool.allocate<test_cpp::Order>();
+    for (int i = 0; i < 2; i++) {
+      zephyr::ByteBuffer in(bb.data(), bb.size());
+      check(order->decode(in, pool, &schema));
+    }
+    zephyr::ByteBuffer again;
+    check(order->encode(again));
+    check(again.size() == bb.size() && !memcmp(again.data(), bb.data(), bb.size()));
+    return true;
+  });
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,842 @@
+#define IMPLEMENT_ZEPHYR_H
+#define IMPLEMENT_SCHEMA_H
+#include "test-cpp.h"
+#include "test-cpp-v2.h"
+
+#include <locale.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A tiny runner in the spirit of test.js. Each test returns false from the
+// first check() that fails.
+#define check(condition) \
+  do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+static int failures = 0;
+
+static void it(const char *name, bool (*test)()) {
+  bool ok = test();
+  printf("%s %s\n", ok ? "ok" : "not ok", name);
+  if (!ok) failures++;
+}
+
+static const char LONG_NOTE[] =
+  "A note that is long enough to be referenced by a gathered encode instead "
+  "of being copied into the buffer";
+
+static void buildOrder(test_cpp::Order &order, zephyr::MemoryPool &pool) {
+  order.set_id(0x123456789ULL);
+  order.set_note(pool.string(LONG_NOTE));
+
+  zephyr::Array<uint8_t> payload = pool.array<uint8_t>(300);
+  for (uint32_t i = 0; i < payload.size(); i++) payload[i] = (uint8_t)i;
+  order.set_payload(payload);
+
+  order.set_kind(test_cpp::Kind::LARGE);
+
+  test_cpp::Point *origin = pool.allocate<test_cpp::Point>();
+  origin->set_x(1.5f);
+  origin->set_y(-2);
+  order.set_origin(origin);
+
+  zephyr::Array<test_cpp::Item> &items = order.set_items(pool, 2);
+  items[0].set_sku(pool.string("apple"));
+  items[0].set_count(3);
+  zephyr::Array<zephyr::String> &tags = items[0].set_tags(pool, 2);
+  tags[0] = pool.string("red");
+  tags[1] = pool.string("fresh");
+  items[1].set_sku(pool.string("pear"));
+
+  zephyr::Array<int32_t> &values = order.set_values(pool, 3);
+  values.set({-1, 0, 1000000});
+
+  test_cpp::Item *gift = pool.allocate<test_cpp::Item>();
+  gift->set_sku(pool.string("card"));
+  order.set_gift(gift);
+}
+
+static void buildOrderV2(test_cpp_v2::Order &order, zephyr::MemoryPool &pool) {
+  order.set_id(7);
+  order.set_note(pool.string("note"));
+
+  zephyr::Array<test_cpp_v2::Item> &items = order.set_items(pool, 1);
+  items[0].set_sku(pool.string("plum"));
+  items[0].set_price(2.25);
+
+  order.set_comment(pool.string("added in v2"));
+  zephyr::Array<uint32_t> &codes = order.set_codes(pool, 2);
+  codes.set({4, 500});
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &result) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return false;
+  uint8_t buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    result.insert(result.end(), buffer, buffer + count);
+  }
+  fclose(file);
+  return true;
+}
+
+// The old reader needs the writer's schema to skip the fields it doesn't know
+static bool parseV2Schema(test_cpp::BinarySchema &schema) {
+  static std::vector<uint8_t> bytes;
+  if (bytes.empty() && !readFile("test-cpp-v2.bzephyr", bytes)) return false;
+  zephyr::ByteBuffer bb(bytes.data(), bytes.size());
+  return schema.parse(bb);
+}
+
+// Existing types that mirror test-cpp.zephyr, described for the template codec
+namespace app {
+  enum class Kind : uint32_t { SMALL = 1, LARGE = 2 };
+  struct Point { float x = 0; float y = 0; };
+  struct Item { std::string sku; uint32_t count = 0; std::vector<std::string> tags; };
+  struct Order {
+    uint64_t id = 0;
+    std::string note;
+    std::vector<uint8_t> payload;
+    Kind kind = Kind::SMALL;
+    Point origin;
+    std::vector<Item> items;
+    std::vector<int32_t> values;
+    Item gift;
+  };
+}
+
+ZEPHYR_STRUCT(app::Point) {
+  ZEPHYR_MEMBER(x);
+  ZEPHYR_MEMBER(y);
+}
+
+ZEPHYR_MESSAGE(app::Item) {
+  ZEPHYR_FIELD(1, sku);
+  ZEPHYR_FIELD(2, count);
+  ZEPHYR_FIELD(3, tags);
+}
+
+ZEPHYR_MESSAGE(app::Order) {
+  ZEPHYR_FIELD(1, id);
+  ZEPHYR_FIELD(2, note);
+  ZEPHYR_FIELD(3, payload);
+  ZEPHYR_FIELD(4, kind);
+  ZEPHYR_FIELD(5, origin);
+  ZEPHYR_FIELD(6, items);
+  ZEPHYR_FIELD(7, values);
+  ZEPHYR_FIELD(8, gift);
+}
+
+// Hands out memory full of garbage and counts what's live
+class DirtyAllocator : public zephyr::Allocator {
+public:
+  explicit DirtyAllocator(size_t minimum = 0) : _minimum(minimum) {}
+
+  void *allocate(size_t size) override {
+    void *data = zephyr::Allocator::heap().allocate(size);
+    memset(data, 0xAB, size);
+    allocations++;
+    live++;
+    return data;
+  }
+
+  void deallocate(void *data, size_t size) override {
+    zephyr::Allocator::heap().deallocate(data, size);
+    live--;
+  }
+
+  size_t minimumSize() const override { return _minimum; }
+
+  size_t allocations = 0;
+  size_t live = 0;
+
+private:
+  size_t _minimum = 0;
+};
+
+// Concatenates the segments of a gathered encode
+static void flatten(const zephyr::ByteBuffer &bb, zephyr::ByteBuffer &out) {
+  zephyr::ByteBuffer::Segment segments[16];
+  size_t count = bb.segments(segments, 16);
+  for (size_t i = 0; i < count && i < 16; i++) {
+    out.writeRawBytes(static_cast<const uint8_t *>(segments[i].iov_base), segments[i].iov_len);
+  }
+}
+
+static bool fromJson(const zephyr::JsonTranscoder &json, const char *text, uint32_t definition, zephyr::ByteBuffer &out) {
+  return json.fromJson(text, strlen(text), definition, out);
+}
+
+static bool same(const zephyr::ByteBuffer &a, const zephyr::ByteBuffer &b) {
+  return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size());
+}
+
+int main() {
+  it("gather segments match a flat encode", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order order;
+    buildOrder(order, pool);
+
+    zephyr::ByteBuffer flat;
+    check(order.encode(flat));
+
+    zephyr::ByteBuffer gathered;
+    gathered.setGatherThreshold(64);
+    check(order.encode(gathered));
+    check(gathered.totalSize() == flat.size());
+    check(gathered.size() < flat.size());
+
+    zephyr::ByteBuffer::Segment segments[16];
+    check(gathered.segments(segments, 16) == 5);
+    check(segments[1].iov_base == order.note()->c_str());
+    check(segments[3].iov_base == order.payload()->data());
+
+    zephyr::ByteBuffer joined;
+    flatten(gathered, joined);
+    check(same(joined, flat));
+    return true;
+  });
+
+  it("unknown fields survive an older reader", [] {
+    zephyr::MemoryPool pool;
+    test_cpp_v2::Order order;
+    buildOrderV2(order, pool);
+    zephyr::ByteBuffer original;
+    check(order.encode(original));
+
+    test_cpp::BinarySchema schema;
+    check(parseV2Schema(schema));
+    test_cpp::Order old;
+    zephyr::ByteBuffer in(original.data(), original.size());
+    check(old.decode(in, pool, &schema));
+    check(*old.id() == 7);
+    check(!old.unknownFields().empty());
+    check(!(*old.items())[0].unknownFields().empty());
+
+    // Known fields come first and unknown ones after, as the writer had them
+    zephyr::ByteBuffer reencoded;
+    check(old.encode(reencoded));
+    check(same(reencoded, original));
+
+    test_cpp_v2::Order decoded;
+    zephyr::ByteBuffer again(reencoded.data(), reencoded.size());
+    check(decoded.decode(again, pool));
+    check(decoded.comment() && !strcmp(decoded.comment()->c_str(), "added in v2"));
+    check(decoded.codes() && (*decoded.codes())[1] == 500);
+    check(*(*decoded.items())[0].price() == 2.25);
+
+    // Without the writer's schema there's no way to skip them
+    test_cpp::Order blind;
+    zephyr::ByteBuffer blindIn(original.data(), original.size());
+    check(!blind.decode(blindIn, pool));
+    return true;
+  });
+
+  it("patchField replaces or appends a top-level field", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order order;
+    buildOrder(order, pool);
+    zephyr::ByteBuffer original;
+    check(order.encode(original));
+
+    test_cpp::BinarySchema schema;
+    zephyr::ByteBuffer value;
+    value.writeString("patched");
+    zephyr::ByteBuffer patched;
+    check(schema.patchOrderField(original.data(), original.size(), 2, value.data(), value.size(), patched));
+
+    test_cpp::Order decoded;
+    zephyr::ByteBuffer in(patched.data(), patched.size());
+    check(decoded.decode(in, pool));
+    check(!strcmp(decoded.note()->c_str(), "patched"));
+    check(*decoded.id() == *order.id());
+    check(decoded.items()->size() == 2 && !strcmp((*decoded.items())[1].sku()->c_str(), "pear"));
+    check(decoded.payload()->size() == 300 && (*decoded.payload())[299] == (uint8_t)299);
+
+    test_cpp::Order sparse;
+    sparse.set_id(1);
+    zephyr::ByteBuffer sparseBytes;
+    check(sparse.encode(sparseBytes));
+    zephyr::ByteBuffer count;
+    count.writeVarUint(0);
+    zephyr::ByteBuffer appended;
+    check(schema.patchOrderField(sparseBytes.data(), sparseBytes.size(), 7, count.data(), count.size(), appended));
+    test_cpp::Order decodedSparse;
+    zephyr::ByteBuffer sparseIn(appended.data(), appended.size());
+    check(decodedSparse.decode(sparseIn, pool));
+    check(*decodedSparse.id() == 1 && decodedSparse.values() && decodedSparse.values()->size() == 0);
+
+    check(!schema.patchOrderField(original.data(), original.size() - 1, 2, value.data(), value.size(), patched));
+    return true;
+  });
+
+  it("pool memory is zeroed over a non-zeroing allocator", [] {
+    DirtyAllocator allocator;
+    {
+      zephyr::MemoryPool pool(allocator, 256);
+      for (int i = 0; i < 64; i++) {
+        test_cpp::Order *order = pool.allocate<test_cpp::Order>();
+        check(!order->id() && !order->note() && !order->origin() && !order->items());
+        zephyr::Array<test_cpp::Item> items = pool.array<test_cpp::Item>(3);
+        check(!items[2].sku() && !items[2].tags());
+      }
+      check(allocator.allocations > 1);
+
+      test_cpp::Order order;
+      buildOrder(order, pool);
+      zephyr::ByteBuffer bb(allocator);
+      check(order.encode(bb));
+      test_cpp::Order decoded;
+      zephyr::ByteBuffer in(bb.data(), bb.size());
+      check(decoded.decode(in, pool));
+      zephyr::ByteBuffer again(allocator);
+      check(decoded.encode(again));
+      check(same(again, bb));
+    }
+    check(allocator.live == 0);
+
+    // Chunks are rounded up to what the allocator asks for
+    DirtyAllocator large(1 << 16);
+    zephyr::MemoryPool pool(large, 256);
+    for (int i = 0; i < 100; i++) pool.allocate<uint8_t>(256);
+    check(large.allocations == 1);
+    return true;
+  });
+
+  it("dense encoding works across schema versions", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::BinarySchema schema;
+    check(parseV2Schema(schema));
+
+    test_cpp_v2::Order order;
+    buildOrderV2(order, pool);
+    test_cpp_v2::Item *gift = pool.allocate<test_cpp_v2::Item>();
+    gift->set_count(9);
+    order.set_gift(gift);
+
+    // Newer fields in the bitmap are skipped with the writer's schema
+    zephyr::ByteBuffer dense;
+    check(order.encodeDense(dense));
+    test_cpp::Order old;
+    zephyr::ByteBuffer in(dense.data(), dense.size());
+    check(old.decodeDense(in, pool, &schema));
+    check(in.index() == dense.size());
+    check(*old.id() == 7 && !strcmp(old.note()->c_str(), "note"));
+    check(*old.gift()->count() == 9);
+    check(old.unknownFields().empty());
+    zephyr::ByteBuffer blindIn(dense.data(), dense.size());
+    check(!test_cpp::Order().decodeDense(blindIn, pool));
+
+    // Fields after the last dense id are written with their ids, so an older
+    // reader can keep them
+    zephyr::ByteBuffer split;
+    check(order.encodeDense(split, 8));
+    zephyr::ByteBuffer splitIn(split.data(), split.size());
+    test_cpp::Order kept;
+    check(kept.decodeDense(splitIn, pool, &schema));
+    check(!kept.unknownFields().empty());
+    zephyr::ByteBuffer forwarded;
+    check(kept.encodeDense(forwarded));
+    test_cpp_v2::Order decoded;
+    zephyr::ByteBuffer forwardedIn(forwarded.data(), forwarded.size());
+    check(decoded.decodeDense(forwardedIn, pool));
+    check(!strcmp(decoded.comment()->c_str(), "added in v2"));
+    check((*decoded.codes())[1] == 500 && *decoded.gift()->count() == 9);
+
+    // Older writers need no schema at all
+    test_cpp::Order older;
+    buildOrder(older, pool);
+    zephyr::ByteBuffer olderDense;
+    check(older.encodeDense(olderDense));
+    test_cpp_v2::Order newer;
+    zephyr::ByteBuffer olderIn(olderDense.data(), olderDense.size());
+    check(newer.decodeDense(olderIn, pool));
+    check(!strcmp(newer.note()->c_str(), LONG_NOTE) && !newer.comment());
+    check(newer.items()->size() == 2 && (*newer.items())[0].tags()->size() == 2);
+
+    zephyr::ByteBuffer tagged;
+    check(newer.encode(tagged));
+    zephyr::ByteBuffer olderTagged;
+    check(older.encode(olderTagged));
+    check(same(tagged, olderTagged));
+    return true;
+  });
+
+  it("dense encoding copies its bitmap when gathering", [] {
+    zephyr::MemoryPool pool;
+    test_cpp_v2::Order order;
+    buildOrderV2(order, pool);
+
+    // The two bitmap bytes reach the threshold, so a reference to them would
+    // point into a stack frame that's gone by the time segments() is read
+    zephyr::ByteBuffer gathered;
+    gathered.setGatherThreshold(2);
+    check(order.encodeDense(gathered));
+    zephyr::ByteBuffer flat;
+    check(order.encodeDense(flat));
+    zephyr::ByteBuffer empty;
+    check(test_cpp_v2::Order().encodeDense(empty));
+
+    check(gathered.totalSize() == flat.size());
+    zephyr::ByteBuffer joined;
+    flatten(gathered, joined);
+    check(same(joined, flat));
+
+    test_cpp_v2::Order decoded;
+    zephyr::ByteBuffer in(joined.data(), joined.size());
+    check(decoded.decodeDense(in, pool));
+    check(!strcmp(decoded.comment()->c_str(), "added in v2"));
+    return true;
+  });
+
+  it("JSON round-trips through the schema", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order order;
+    buildOrder(order, pool);
+    zephyr::ByteBuffer encoded;
+    check(order.encode(encoded));
+
+    test_cpp::BinarySchema schema;
+    const zephyr::BinarySchema &underlying = schema.underlyingSchema();
+    uint32_t type;
+    check(underlying.findDefinition("Order", type));
+    zephyr::JsonTranscoder json(underlying);
+
+    zephyr::ByteBuffer text;
+    zephyr::ByteBuffer in(encoded.data(), encoded.size());
+    check(json.toJson(in, type, text));
+    zephyr::ByteBuffer back;
+    check(json.fromJson(reinterpret_cast<const char *>(text.data()), text.size(), type, back));
+    check(same(back, encoded));
+
+    zephyr::ByteBuffer sparse;
+    check(fromJson(json, "{\"id\": \"18446744073709551615\", \"kind\": \"SMALL\", \"origin\": {\"y\": 2, \"x\": 1}}", type, sparse));
+    test_cpp::Order decoded;
+    zephyr::ByteBuffer sparseIn(sparse.data(), sparse.size());
+    check(decoded.decode(sparseIn, pool));
+    check(*decoded.id() == UINT64_MAX && *decoded.kind() == test_cpp::Kind::SMALL);
+    check(*decoded.origin()->x() == 1 && *decoded.origin()->y() == 2);
+    return true;
+  });
+
+  it("JSON strings decode escapes to valid UTF-8", [] {
+    test_cpp::BinarySchema schema;
+    const zephyr::BinarySchema &underlying = schema.underlyingSchema();
+    uint32_t type;
+    check(underlying.findDefinition("Item", type));
+    zephyr::JsonTranscoder json(underlying);
+    zephyr::MemoryPool pool;
+
+    struct { const char *json; const char *sku; } cases[] = {
+      {"{\"sku\": \"a\\u00e9\\n\"}", "a\xC3\xA9\n"},
+      {"{\"sku\": \"\\ud83d\\ude00\"}", "\xF0\x9F\x98\x80"},
+      {"{\"sku\": \"\\ud83d\"}", "\xEF\xBF\xBD"},
+      {"{\"sku\": \"\\ude00x\"}", "\xEF\xBF\xBDx"},
+      {"{\"sku\": \"\\ud83d\\u0041\"}", "\xEF\xBF\xBD" "A"},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+      zephyr::ByteBuffer out;
+      check(fromJson(json, cases[i].json, type, out));
+      test_cpp::Item item;
+      zephyr::ByteBuffer in(out.data(), out.size());
+      check(item.decode(in, pool));
+      check(!strcmp(item.sku()->c_str(), cases[i].sku));
+    }
+
+    zephyr::ByteBuffer out;
+    check(!fromJson(json, "{\"sku\": \"\\ud83d\\u00\"}", type, out));
+    return true;
+  });
+
+  it("JSON numbers ignore the locale's decimal point", [] {
+    const char *names[] = {"de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "ru_RU.UTF-8"};
+    std::string previous = setlocale(LC_NUMERIC, nullptr);
+    bool found = false;
+    for (const char *name : names) {
+      if (setlocale(LC_NUMERIC, name) && strcmp(localeconv()->decimal_point, ".")) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      setlocale(LC_NUMERIC, previous.c_str());
+      printf("  (no locale with another decimal point, skipped)\n");
+      return true;
+    }
+
+    test_cpp::BinarySchema schema;
+    const zephyr::BinarySchema &underlying = schema.underlyingSchema();
+    uint32_t type;
+    bool ok = underlying.findDefinition("Point", type);
+    zephyr::JsonTranscoder json(underlying);
+    zephyr::ByteBuffer bb, text;
+    ok = ok && fromJson(json, "{\"x\": 1.5, \"y\": -0.25}", type, bb);
+    zephyr::ByteBuffer in(bb.data(), bb.size());
+    ok = ok && json.toJson(in, type, text);
+    setlocale(LC_NUMERIC, previous.c_str());
+    check(ok);
+
+    std::string written(reinterpret_cast<const char *>(text.data()), text.size());
+    check(written.find("1.5") != std::string::npos && written.find("-0.25") != std::string::npos);
+    return true;
+  });
+
+  it("JSON skips unknown keys strictly", [] {
+    test_cpp::BinarySchema schema;
+    const zephyr::BinarySchema &underlying = schema.underlyingSchema();
+    uint32_t type;
+    check(underlying.findDefinition("Item", type));
+    zephyr::JsonTranscoder json(underlying);
+
+    const char *valid[] = {
+      "{\"other\": [1, \"two\", {\"three\": [true, null, -4.5e1]}, [], {}], \"count\": 2}",
+      "{\"other\": {\"a\": {\"b\": []}}}",
+      "{\"other\": \"x\"}",
+    };
+    const char *invalid[] = {
+      "{\"other\": [1 2]}",
+      "{\"other\": {\"a\": 1 \"b\": 2}}",
+      "{\"other\": {\"a\" 1}}",
+      "{\"other\": {1: 2}}",
+      "{\"other\": [1,]}",
+      "{\"other\": {\"a\": 1,}}",
+      "{\"other\": [1}",
+      "{\"other\": [[[",
+      "{\"other\": }",
+    };
+    for (size_t i = 0; i < sizeof(valid) / sizeof(*valid); i++) {
+      zephyr::ByteBuffer out;
+      check(fromJson(json, valid[i], type, out));
+    }
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+      zephyr::ByteBuffer out;
+      check(!fromJson(json, invalid[i], type, out));
+    }
+    return true;
+  });
+
+  it("template codec matches the generated classes", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order order;
+    buildOrder(order, pool);
+
+    // The codec writes every field, so fill in the ones buildOrder() skips
+    zephyr::Array<test_cpp::Item> &items = *order.items();
+    items[1].set_count(0);
+    items[1].set_tags(pool, 0);
+    order.gift()->set_count(1);
+    order.gift()->set_tags(pool, 1)[0] = pool.string("boxed");
+    zephyr::ByteBuffer generated;
+    check(order.encode(generated));
+
+    app::Order decoded;
+    zephyr::ByteBuffer in(generated.data(), generated.size());
+    check(zephyr::decode(in, decoded));
+    check(decoded.id == 0x123456789ULL && decoded.note == LONG_NOTE);
+    check(decoded.payload.size() == 300 && decoded.kind == app::Kind::LARGE);
+    check(decoded.origin.x == 1.5f && decoded.items.size() == 2);
+    check(decoded.items[0].tags.size() == 2 && decoded.items[0].tags[1] == "fresh");
+    check(decoded.values[2] == 1000000 && decoded.gift.tags[0] == "boxed");
+
+    zephyr::ByteBuffer encoded;
+    zephyr::encode(encoded, decoded);
+    check(same(encoded, generated));
+    return true;
+  });
+
+  it("template codec resets members missing from the input", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order full;
+    buildOrder(full, pool);
+    zephyr::ByteBuffer fullBytes;
+    check(full.encode(fullBytes));
+
+    test_cpp::Order sparse;
+    sparse.set_id(5);
+    zephyr::Array<test_cpp::Item> &items = sparse.set_items(pool, 1);
+    items[0].set_count(8);
+    zephyr::ByteBuffer sparseBytes;
+    check(sparse.encode(sparseBytes));
+
+    app::Order decoded;
+    zephyr::ByteBuffer fullIn(fullBytes.data(), fullBytes.size());
+    check(zephyr::decode(fullIn, decoded));
+    zephyr::ByteBuffer sparseIn(sparseBytes.data(), sparseBytes.size());
+    check(zephyr::decode(sparseIn, decoded));
+
+    app::Order fresh;
+    zephyr::ByteBuffer freshIn(sparseBytes.data(), sparseBytes.size());
+    check(zephyr::decode(freshIn, fresh));
+
+    zephyr::ByteBuffer a;
+    zephyr::ByteBuffer b;
+    zephyr::encode(a, decoded);
+    zephyr::encode(b, fresh);
+    check(same(a, b));
+    check(decoded.id == 5 && decoded.note.empty() && decoded.payload.empty());
+    check(decoded.origin.x == 0 && decoded.values.empty() && decoded.gift.sku.empty());
+    check(decoded.items.size() == 1 && decoded.items[0].sku.empty() && decoded.items[0].tags.empty());
+    check(decoded.items[0].count == 8);
+    return true;
+  });
+
+  it("template codec decodes over the members it reads", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order full;
+    buildOrder(full, pool);
+    zephyr::ByteBuffer fullBytes;
+    check(full.encode(fullBytes));
+
+    test_cpp::Order smaller;
+    zephyr::Array<test_cpp::Item> &items = smaller.set_items(pool, 1);
+    items[0].set_tags(pool, 1)[0] = pool.string("red");
+    smaller.set_note(pool.string("short"));
+    zephyr::ByteBuffer smallerBytes;
+    check(smaller.encode(smallerBytes));
+
+    app::Order decoded;
+    zephyr::ByteBuffer fullIn(fullBytes.data(), fullBytes.size());
+    check(zephyr::decode(fullIn, decoded));
+    size_t noteCapacity = decoded.note.capacity();
+    size_t tagsCapacity = decoded.items[0].tags.capacity();
+    check(tagsCapacity >= 2);
+
+    // Shrinking keeps the storage of the vectors and strings that were read
+    zephyr::ByteBuffer smallerIn(smallerBytes.data(), smallerBytes.size());
+    check(zephyr::decode(smallerIn, decoded));
+    check(decoded.note == "short" && decoded.note.capacity() == noteCapacity);
+    check(decoded.items.size() == 1 && decoded.items[0].tags.size() == 1);
+    check(decoded.items[0].tags.capacity() == tagsCapacity && decoded.items[0].tags[0] == "red");
+    check(decoded.items[0].sku.empty() && decoded.id == 0 && decoded.values.empty());
+    return true;
+  });
+
+  it("template codec skips unknown fields in any order", [] {
+    zephyr::MemoryPool pool;
+    test_cpp_v2::Order order;
+    buildOrderV2(order, pool);
+    zephyr::ByteBuffer bb;
+    check(order.encode(bb));
+
+    test_cpp::BinarySchema schema;
+    check(parseV2Schema(schema));
+    app::Order decoded;
+    zephyr::ByteBuffer in(bb.data(), bb.size());
+    check(zephyr::decode(in, decoded, &schema.underlyingSchema()));
+    check(in.index() == bb.size());
+    check(decoded.id == 7 && decoded.items.size() == 1 && decoded.items[0].sku == "plum");
+
+    zephyr::ByteBuffer blind(bb.data(), bb.size());
+    check(!zephyr::decode(blind, decoded));
+
+    // Fields written out of order still land in the right members
+    zephyr::ByteBuffer reversed;
+    reversed.writeVarUint(7);
+    reversed.writeVarUint(1);
+    reversed.writeVarInt(-3);
+    reversed.writeVarUint(2);
+    reversed.writeString("later");
+    reversed.writeVarUint(1);
+    reversed.writeVarUint64(42);
+    reversed.writeVarUint(0);
+    zephyr::ByteBuffer reversedIn(reversed.data(), reversed.size());
+    check(zephyr::decode(reversedIn, decoded));
+    check(decoded.id == 42 && decoded.note == "later" && decoded.values.size() == 1 && decoded.values[0] == -3);
+    check(decoded.items.empty());
+    return true;
+  });
+
+  it("reuse decodes in a loop without new chunks", [] {
+    zephyr::MemoryPool scratch;
+    test_cpp::Order large;
+    buildOrder(large, scratch);
+    zephyr::ByteBuffer largeBytes;
+    check(large.encode(largeBytes));
+
+    // Empty strings and bytes must not touch the storage they don't have
+    test_cpp::Order small;
+    small.set_id(1);
+    small.set_note(zephyr::String("", 0));
+    small.set_payload(scratch.array<uint8_t>(0));
+    small.set_items(scratch, 1)[0].set_sku(zephyr::String("", 0));
+    zephyr::ByteBuffer smallBytes;
+    check(small.encode(smallBytes));
+
+    DirtyAllocator allocator;
+    zephyr::MemoryPool pool(allocator, 4096);
+    test_cpp::Order decoded;
+    zephyr::ByteBuffer fresh(smallBytes.data(), smallBytes.size());
+    check(decoded.decode(fresh, pool));
+    check(decoded.note() && !decoded.note()->length() && !decoded.payload()->size() && !decoded.origin());
+
+    // Nested messages the caller set are replaced, not written to
+    test_cpp::Item mine;
+    mine.set_sku(pool.string("mine"));
+    decoded.set_gift(&mine);
+
+    size_t allocations = 0;
+    test_cpp::Item *gift = nullptr;
+    for (int i = 0; i < 64; i++) {
+      const zephyr::ByteBuffer &source = i % 2 ? smallBytes : largeBytes;
+      zephyr::ByteBuffer in(source.data(), source.size());
+      check(decoded.decode(in, pool));
+      zephyr::ByteBuffer out;
+      check(decoded.encode(out));
+      check(same(out, source));
+
+      if (i == 1) {
+        allocations = allocator.allocations;
+      } else if (i == 0) {
+        gift = decoded.gift();
+      }
+      check(i % 2 ? !decoded.gift() : decoded.gift() == gift);
+    }
+    check(gift && gift != &mine);
+    check(*mine.sku() == zephyr::String("mine"));
+    check(allocator.allocations == allocations);
+    return true;
+  });
+
+  it("reuse skips deprecated fields without new chunks", [] {
+    zephyr::MemoryPool scratch;
+    test_cpp::Order order;
+    buildOrder(order, scratch);
+    zephyr::ByteBuffer bytes;
+    check(order.encode(bytes));
+
+    DirtyAllocator allocator;
+    zephyr::MemoryPool pool(allocator, 4096);
+    test_cpp::LegacyOrder legacy;
+    size_t allocations = 0;
+    for (int i = 0; i < 64; i++) {
+      zephyr::ByteBuffer in(bytes.data(), bytes.size());
+      check(legacy.decode(in, pool));
+      check(in.index() == bytes.size() && *legacy.id() == 0x123456789ULL);
+      if (i == 0) allocations = allocator.allocations;
+    }
+    check(allocator.allocations == allocations);
+    return true;
+  });
+
+  it("reuse never writes over values it didn't decode", [] {
+    zephyr::MemoryPool pool;
+    test_cpp::Order large;
+    buildOrder(large, pool);
+    zephyr::ByteBuffer largeBytes;
+    check(large.encode(largeBytes));
+    test_cpp::Order small;
+    small.set_note(pool.string("tiny"));
+    small.set_payload(pool.array<uint8_t>(1));
+    small.set_items(pool, 1)[0].set_tags(pool, 1)[0] = pool.string("x");
+    small.set_gift(pool.allocate<test_cpp::Item>());
+    zephyr::ByteBuffer smallBytes;
+    check(small.encode(smallBytes));
+
+    test_cpp::Order first;
+    zephyr::ByteBuffer in(largeBytes.data(), largeBytes.size());
+    check(first.decode(in, pool));
+
+    // Strings and bytes handed to a setter are copies without any room
+    test_cpp::Order second;
+    second.set_note(*first.note());
+    second.set_payload(*first.payload());
+    second.set_items(pool, 1)[0].set_tags(pool, 1)[0] = (*(*first.items())[0].tags())[0];
+    zephyr::ByteBuffer secondIn(smallBytes.data(), smallBytes.size());
+    check(second.decode(secondIn, pool));
+
+    // So are the members of a copied message
+    test_cpp::Order third = first;
+    zephyr::ByteBuffer thirdIn(smallBytes.data(), smallBytes.size());
+    check(third.decode(thirdIn, pool));
+    check(third.gift() != first.gift());
+
+    zephyr::ByteBuffer out;
+    check(first.encode(out));
+    check(same(out, largeBytes));
+    return true;
+  });
+
+  it("reuse gives up its storage before the pool is cleared", [] {
+    zephyr::MemoryPool scratch;
+    test_cpp::Order order;
+    buildOrder(order, scratch);
+    zephyr::ByteBuffer bytes;
+    check(order.encode(bytes));
+
+    zephyr::MemoryPool pool;
+    test_cpp::Order decoded;
+    zephyr::ByteBuffer in(bytes.data(), bytes.size());
+    check(decoded.decode(in, pool));
+    decoded.releaseStorage();
+    check(!decoded.id() && !decoded.note() && !decoded.items() && !decoded.gift());
+    pool.clear();
+
+    // Decoding again allocates fresh storage instead of writing to freed chunks
+    zephyr::ByteBuffer again(bytes.data(), bytes.size());
+    check(decoded.decode(again, pool));
+    zephyr::ByteBuffer out;
+    check(decoded.encode(out));
+    check(same(out, bytes));
+    return true;
+  });
+
+  it("schema registry publishes and reloads versions", [] {
+    std::vector<uint8_t> v1, v2;
+    check(readFile("test-cpp.bzephyr", v1) && readFile("test-cpp-v2.bzephyr", v2));
+
+    zephyr::SchemaRegistry<test_cpp::BinarySchema> registry;
+    check(!registry.current() && registry.version() == 0);
+
+    const test_cpp::BinarySchema *first = registry.load(v1.data(), v1.size());
+    check(first && registry.current() == first && registry.version() == 1);
+    check(registry.load(v1.data(), v1.size()) == first && registry.version() == 1);
+
+    const test_cpp::BinarySchema *second = registry.load(v2.data(), v2.size());
+    check(second && second != first && registry.current() == second && registry.version() == 2);
+    check(registry.find(zephyr::SchemaRegistry<test_cpp::BinarySchema>::hash(v1.data(), v1.size())) == first);
+
+    // Going back to an older schema brings back its entry
+    check(registry.load(v1.data(), v1.size()) == first);
+    check(registry.current() == first && registry.version() == 1);
+
+    const uint8_t invalid[] = {0xFF, 0xFF, 0xFF};
+    check(!registry.load(invalid, sizeof(invalid)));
+    check(registry.current() == first && registry.version() == 1);
+    return true;
+  });
+
+  it("schema registry readers see whole entries while reloading", [] {
+    std::vector<uint8_t> v1, v2;
+    check(readFile("test-cpp.bzephyr", v1) && readFile("test-cpp-v2.bzephyr", v2));
+
+    zephyr::SchemaRegistry<test_cpp::BinarySchema> registry;
+    const test_cpp::BinarySchema *first = registry.load(v1.data(), v1.size());
+    const test_cpp::BinarySchema *second = registry.load(v2.data(), v2.size());
+    check(first && second);
+
+    std::atomic<bool> done(false);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+      readers.emplace_back([&] {
+        while (!done.load()) {
+          const test_cpp::BinarySchema *schema = registry.current();
+          uint32_t version = registry.version();
+          if ((schema != first && schema != second) || version < 1 || version > 2) ok = false;
+        }
+      });
+    }
+    for (int i = 0; i < 1000; i++) {
+      const std::vector<uint8_t> &bytes = i % 2 ? v2 : v1;
+      if (registry.load(bytes.data(), bytes.size()) != (i % 2 ? second : first)) ok = false;
+    }
+    done = true;
+    for (std::thread &reader : readers) reader.join();
+    check(ok.load());
+    return true;
+  });
+
+  return failures ? 1 : 0;
+}
@@ -13,5 +13,16 @@ node ../ts/cli.ts --schema ./test-schema.bzephyr --text ./test-schema-round-trip
 
 node ../ts/cli.ts --schema ./test-schema.zephyr --cpp ./test-schema.h
 
-rm -f ./test-schema.bzephyr
+node ../ts/cli.ts --schema ./test-cpp.zephyr --cpp ./test-cpp.h --cpp-unknown-fields --cpp-dense --cpp-reuse
+node ../ts/cli.ts --schema ./test-cpp-v2.zephyr --cpp ./test-cpp-v2.h --cpp-dense
+node ../ts/cli.ts --schema ./test-cpp.zephyr --binary ./test-cpp.bzephyr
+node ../ts/cli.ts --schema ./test-cpp-v2.zephyr --binary ./test-cpp-v2.bzephyr
+c++ -std=c++11 -Wall -pthread -I.. ./test.cpp -o ./test-cpp
+./test-cpp
+
+node ../ts/cli.ts --schema ./test-cpp.zephyr --cpp ./test-cpp-compact.h --cpp-compact --cpp-unknown-fields
+c++ -std=c++11 -Wall -I.. ./test-compact.cpp -o ./test-cpp-compact
+./test-cpp-compact
+
+rm -f ./test-schema.bzephyr ./test-cpp.bzephyr ./test-cpp-v2.bzephyr ./test-cpp ./test-cpp-compact
 
@@ -24,6 +24,10 @@ Options:
   --ts-guards           Generate type guard functions (use with --ts).
   --ts-no-input-types   Don't generate separate input types (use with --ts).
   --cpp [PATH]          Generate C++ code.
+  --cpp-unknown-fields  Keep unknown fields and re-encode them (use with --cpp).
+  --cpp-compact         Generate a compact memory layout (use with --cpp).
+  --cpp-dense           Add presence-bitmap encodeDense()/decodeDense() (use with --cpp).
+  --cpp-reuse           Reuse existing storage when decoding (use with --cpp).
   --rust [PATH]         Generate Rust code.
   --text [PATH]         Encode the schema as text.
   --binary [PATH]       Encode the schema as a binary blob.
@@ -83,6 +87,10 @@ function main(args: string[]): number {
     "--ts-readonly": false,
     "--ts-guards": false,
     "--ts-no-input-types": false,
+    "--cpp-unknown-fields": false,
+    "--cpp-compact": false,
+    "--cpp-dense": false,
+    "--cpp-reuse": false,
   };
 
   for (let i = 0; i < args.length; i++) {
@@ -171,7 +179,13 @@ function main(args: string[]): number {
   }
 
   if (flags["--cpp"] !== null) {
-    writeFileString(flags["--cpp"], compileSchemaCPP(parsed));
+    const cppOptions = {
+      unknownFields: boolFlags["--cpp-unknown-fields"],
+      compact: boolFlags["--cpp-compact"],
+      dense: boolFlags["--cpp-dense"],
+      reuse: boolFlags["--cpp-reuse"],
+    };
+    writeFileString(flags["--cpp"], compileSchemaCPP(parsed, cppOptions));
   }
 
   if (flags["--rust"] !== null) {
@@ -1404,7 +1404,7 @@ function compileSchemaTypeScriptDeclaration(schema) {
 }
 
 // cpp.ts
-function cppType(definitions, field, isArray) {
+function cppType(definitions, field, isArray, compact = false) {
   let type;
   switch (field.type) {
     case "bool":
@@ -1432,7 +1432,7 @@ function cppType(definitions, field, isArray) {
       type = "zephyr::String";
       break;
     case "bytes":
-      type = "zephyr::Array<uint8_t>";
+      type = compact ? "zephyr::CompactArray<uint8_t>" : "zephyr::Array<uint8_t>";
       break;
     case "int64":
       type = "int64_t";
@@ -1454,23 +1454,263 @@ function cppType(definitions, field, isArray) {
     }
   }
   if (isArray || field.isFixedArray) {
-    type = "zephyr::Array<" + type + ">";
+    type = (compact ? "zephyr::CompactArray<" : "zephyr::Array<") + type + ">";
   }
   return type;
 }
 function cppFieldName(field) {
   return "_data_" + field.name;
 }
-function cppFlagIndex(i) {
-  return i >> 5;
+function cppOwnedName(field) {
+  return "_owned_" + field.name;
 }
-function cppFlagMask(i) {
-  return 1 << i % 32 >>> 0;
+function cppFlagBits(compact) {
+  return compact ? 8 : 32;
 }
-function cppIsFieldPointer(definitions, field) {
-  return !field.isArray && !field.isFixedArray && !field.isMap && field.type in definitions && definitions[field.type].kind !== "ENUM";
+function cppFlagIndex(i, compact = false) {
+  return Math.floor(i / cppFlagBits(compact));
 }
-function compileSchemaCPP(schema) {
+function cppFlagMask(i, compact = false) {
+  return 1 << i % cppFlagBits(compact) >>> 0;
+}
+function cppIsFieldPointer(definitions, field, compact = false) {
+  return !field.isArray && !field.isFixedArray && !field.isMap && field.type in definitions && definitions[field.type].kind !== "ENUM" && !(compact && definitions[field.type].kind === "STRUCT");
+}
+function cppIsCompactBytes(field, compact) {
+  return compact && field.type === "bytes" && !field.isArray && !field.isFixedArray;
+}
+function cppIsFieldObject(definitions, field) {
+  return field.type in definitions && definitions[field.type].kind !== "ENUM";
+}
+function cppIsFieldInline(definitions, field, compact) {
+  return compact && !field.isArray && !field.isFixedArray && !field.isMap && field.type in definitions && definitions[field.type].kind === "STRUCT";
+}
+function cppCompactAlignment(definitions, field) {
+  const sizes = {
+    bool: 1,
+    byte: 1,
+    int: 4,
+    uint: 4,
+    float: 4,
+    float16: 4,
+    double: 8
+  };
+  if (field.isArray || field.isFixedArray || field.type === "bytes") {
+    return 4;
+  }
+  if (field.type in sizes) {
+    return sizes[field.type];
+  }
+  const definition = definitions[field.type];
+  if (definition && definition.kind === "ENUM") {
+    return 4;
+  }
+  if (cppIsFieldInline(definitions, field, true)) {
+    let alignment = 1;
+    for (let i = 0; i < definition.fields.length; i++) {
+      const item = definition.fields[i];
+      if (!item.isDeprecated) {
+        alignment = Math.max(alignment, cppCompactAlignment(definitions, item));
+      }
+    }
+    return alignment;
+  }
+  return 8;
+}
+function cppDefinitionOrder(definitions, schema, compact) {
+  if (!compact) {
+    return schema.definitions;
+  }
+  const order = [];
+  const state = {};
+  function visit(definition) {
+    if (state[definition.name] === 2) {
+      return;
+    }
+    if (state[definition.name] === 1) {
+      error(
+        "Struct " + quote(definition.name) + " contains itself",
+        definition.line,
+        definition.column
+      );
+    }
+    state[definition.name] = 1;
+    for (let i = 0; i < definition.fields.length; i++) {
+      const field = definition.fields[i];
+      if (!field.isDeprecated && cppIsFieldInline(definitions, field, true)) {
+        visit(definitions[field.type]);
+      }
+    }
+    state[definition.name] = 2;
+    order.push(definition);
+  }
+  for (let i = 0; i < schema.definitions.length; i++) {
+    visit(schema.definitions[i]);
+  }
+  return order;
+}
+const cppBinaryTypes = [
+  "bool",
+  "byte",
+  "int",
+  "uint",
+  "float",
+  "float16",
+  "double",
+  "string",
+  "bytes",
+  "int64",
+  "uint64"
+];
+function cppBinaryType(definitionIndex, type) {
+  if (!type) {
+    return 0;
+  }
+  const index = cppBinaryTypes.indexOf(type);
+  return index === -1 ? definitionIndex[type] : ~index;
+}
+function cppPushIndented(cpp, indent, lines) {
+  for (let i = 0; i < lines.length; i++) {
+    cpp.push(indent + lines[i]);
+  }
+}
+function cppStringLiteral(text) {
+  return "zephyr::String(" + quote(text) + ", " + text.length + ")";
+}
+function cppSchemaTables(schema) {
+  const definitionIndex = {};
+  const kinds2 = ["ENUM", "STRUCT", "MESSAGE"];
+  const cpp = [];
+  for (let i = 0; i < schema.definitions.length; i++) {
+    definitionIndex[schema.definitions[i].name] = i;
+  }
+  for (let i = 0; i < schema.definitions.length; i++) {
+    const definition = schema.definitions[i];
+    if (definition.fields.length === 0) {
+      continue;
+    }
+    cpp.push(
+      "  static constexpr zephyr::BinarySchema::Field _fields" + definition.name + "[] = {"
+    );
+    for (let j = 0; j < definition.fields.length; j++) {
+      const field = definition.fields[j];
+      cpp.push(
+        "    zephyr::BinarySchema::Field(" + cppStringLiteral(field.name) + ", " + cppBinaryType(definitionIndex, field.type) + ", " + field.isArray + ", " + field.isFixedArray + ", " + field.isMap + ", " + (field.isFixedArray && field.arraySize !== void 0 ? field.arraySize : 0) + ", " + (field.isMap ? cppBinaryType(definitionIndex, field.keyType) : 0) + ", " + field.value + "),"
+      );
+    }
+    cpp.push("  };");
+  }
+  cpp.push(
+    "  static constexpr zephyr::BinarySchema::Definition _definitions[] = {"
+  );
+  for (let i = 0; i < schema.definitions.length; i++) {
+    const definition = schema.definitions[i];
+    const fields = definition.fields.length === 0 ? "nullptr, 0" : "_fields" + definition.name + ", " + definition.fields.length;
+    cpp.push(
+      "    zephyr::BinarySchema::Definition(" + cppStringLiteral(definition.name) + ", " + kinds2.indexOf(definition.kind) + ", zephyr::Array<const zephyr::BinarySchema::Field>(" + fields + ")),"
+    );
+  }
+  cpp.push("  };");
+  return cpp;
+}
+function cppDenseMethods(cpp, definition, encodeBodies, decodeBodies, unknownFields, compact, reuse) {
+  function byId(a, b) {
+    return a.field.value - b.field.value;
+  }
+  function bit(id) {
+    return "_bitmap[" + (id - 1 >> 3) + "] & " + (1 << (id - 1 & 7));
+  }
+  encodeBodies = encodeBodies.slice().sort(byId);
+  decodeBodies = decodeBodies.slice().sort(byId);
+  const lastEncoded = encodeBodies.length ? encodeBodies[encodeBodies.length - 1].field.value : 0;
+  const lastDecoded = decodeBodies.length ? decodeBodies[decodeBodies.length - 1].field.value : 0;
+  cpp.push(
+    "bool " + definition.name + "::encodeDense(zephyr::ByteBuffer &_bb, uint32_t _last) {"
+  );
+  cpp.push(
+    "  uint8_t _bitmap[" + Math.max(1, lastEncoded + 7 >> 3) + "] = {};"
+  );
+  cpp.push("  if (_last > " + lastEncoded + ") _last = " + lastEncoded + ";");
+  for (let i = 0; i < encodeBodies.length; i++) {
+    const field = encodeBodies[i].field;
+    cpp.push(
+      "  if (" + field.name + "() != nullptr && _last >= " + field.value + ") _bitmap[" + (field.value - 1 >> 3) + "] |= " + (1 << (field.value - 1 & 7)) + ";"
+    );
+  }
+  cpp.push("  _bb.writeVarUint(_last);");
+  cpp.push(
+    "  for (uint32_t _i = 0; _i < (_last + 7) >> 3; _i++) _bb.writeByte(_bitmap[_i]);"
+  );
+  for (let i = 0; i < encodeBodies.length; i++) {
+    cpp.push("  if (" + bit(encodeBodies[i].field.value) + ") {");
+    cppPushIndented(cpp, "    ", encodeBodies[i].body);
+    cpp.push("  }");
+  }
+  for (let i = 0; i < encodeBodies.length; i++) {
+    const field = encodeBodies[i].field;
+    cpp.push(
+      "  if (_last < " + field.value + " && " + field.name + "() != nullptr) {"
+    );
+    cpp.push("    _bb.writeVarUint(" + field.value + ");");
+    cppPushIndented(cpp, "    ", encodeBodies[i].body);
+    cpp.push("  }");
+  }
+  if (unknownFields) {
+    cpp.push("  _unknownFields.encode(_bb);");
+  }
+  cpp.push("  _bb.writeVarUint(0);");
+  cpp.push("  return true;");
+  cpp.push("}");
+  cpp.push("");
+  cpp.push(
+    "bool " + definition.name + "::decodeDense(zephyr::ByteBuffer &_bb, zephyr::MemoryPool &_pool, const BinarySchema *_schema) {"
+  );
+  cpp.push("  zephyr::PresenceBitmap _bitmap;");
+  for (let i = 0; i < decodeBodies.length; i++) {
+    const field = decodeBodies[i].field;
+    if (field.isArray || field.isFixedArray) {
+      cpp.push("  uint32_t _count;");
+      break;
+    }
+  }
+  cpp.push("  if (!_bitmap.read(_bb)) return false;");
+  if (reuse) {
+    cpp.push("  memset(_flags, 0, sizeof(_flags));");
+  }
+  for (let i = 0; i < decodeBodies.length; i++) {
+    cpp.push("  if (_bitmap.has(" + decodeBodies[i].field.value + ")) {");
+    cppPushIndented(cpp, "    ", decodeBodies[i].body);
+    cpp.push("  }");
+  }
+  cpp.push(
+    "  if (_bitmap.any(" + (lastDecoded + 1) + ") && (!_schema || !_schema->skip" + definition.name + "DenseFields(_bb, _bitmap, " + (lastDecoded + 1) + ", UINT32_MAX))) return false;"
+  );
+  if (reuse) {
+    const type = compact ? "uint8_t" : "uint32_t";
+    const count = cppFlagIndex(
+      definition.fields.length + cppFlagBits(compact) - 1,
+      compact
+    );
+    cpp.push("  " + type + " _dense[" + count + "];");
+    cpp.push("  memcpy(_dense, _flags, sizeof(_flags));");
+    cpp.push("  if (!decode(_bb, _pool, _schema)) return false;");
+    cpp.push(
+      "  for (uint32_t _i = 0; _i < " + count + "; _i++) _flags[_i] |= _dense[_i];"
+    );
+    cpp.push("  return true;");
+  } else {
+    cpp.push("  return decode(_bb, _pool, _schema);");
+  }
+  cpp.push("}");
+  cpp.push("");
+}
+function compileSchemaCPP(schema, options = {}) {
+  const {
+    unknownFields = false,
+    compact = false,
+    dense = false,
+    reuse = false
+  } = options;
   const definitions = {};
   const cpp = [];
   cpp.push('#include "zephyr.h"');
@@ -1488,6 +1728,9 @@ function compileSchemaCPP(schema) {
   }
   cpp.push("class BinarySchema {");
   cpp.push("public:");
+  cpp.push(
+    "  constexpr BinarySchema() : _schema(_definitions, " + schema.definitions.length + ") {}"
+  );
   cpp.push("  bool parse(zephyr::ByteBuffer &bb);");
   cpp.push(
     "  const zephyr::BinarySchema &underlyingSchema() const { return _schema; }"
@@ -1498,6 +1741,14 @@ function compileSchemaCPP(schema) {
       cpp.push(
         "  bool skip" + definition.name + "Field(zephyr::ByteBuffer &bb, uint32_t id) const;"
       );
+      cpp.push(
+        "  bool patch" + definition.name + "Field(const uint8_t *data, size_t size, uint32_t id, const uint8_t *value, size_t length, zephyr::ByteBuffer &out) const;"
+      );
+      if (dense) {
+        cpp.push(
+          "  bool skip" + definition.name + "DenseFields(zephyr::ByteBuffer &bb, const zephyr::PresenceBitmap &bitmap, uint32_t first, uint32_t last) const;"
+        );
+      }
     }
   }
   cpp.push("");
@@ -1506,9 +1757,11 @@ function compileSchemaCPP(schema) {
   for (let i = 0; i < schema.definitions.length; i++) {
     const definition = schema.definitions[i];
     if (definition.kind === "MESSAGE") {
-      cpp.push("  uint32_t _index" + definition.name + " = 0;");
+      cpp.push("  uint32_t _index" + definition.name + " = " + i + ";");
     }
   }
+  cpp.push("");
+  cpp.push.apply(cpp, cppSchemaTables(schema));
   cpp.push("};");
   cpp.push("");
   for (let i = 0; i < schema.definitions.length; i++) {
@@ -1537,6 +1790,20 @@ function compileSchemaCPP(schema) {
       }
       cpp.push("#ifdef IMPLEMENT_SCHEMA_H");
       cpp.push("");
+      cpp.push("#if __cplusplus < 201703L");
+      for (let i = 0; i < schema.definitions.length; i++) {
+        const definition = schema.definitions[i];
+        if (definition.fields.length !== 0) {
+          cpp.push(
+            "constexpr zephyr::BinarySchema::Field BinarySchema::_fields" + definition.name + "[];"
+          );
+        }
+      }
+      cpp.push(
+        "constexpr zephyr::BinarySchema::Definition BinarySchema::_definitions[];"
+      );
+      cpp.push("#endif");
+      cpp.push("");
       cpp.push("bool BinarySchema::parse(zephyr::ByteBuffer &bb) {");
       cpp.push("  if (!_schema.parse(bb)) return false;");
       for (let i = 0; i < schema.definitions.length; i++) {
@@ -1561,11 +1828,30 @@ function compileSchemaCPP(schema) {
           );
           cpp.push("}");
           cpp.push("");
+          cpp.push(
+            "bool BinarySchema::patch" + definition.name + "Field(const uint8_t *data, size_t size, uint32_t id, const uint8_t *value, size_t length, zephyr::ByteBuffer &out) const {"
+          );
+          cpp.push(
+            "  return _schema.patchField(data, size, _index" + definition.name + ", id, value, length, out);"
+          );
+          cpp.push("}");
+          cpp.push("");
+          if (dense) {
+            cpp.push(
+              "bool BinarySchema::skip" + definition.name + "DenseFields(zephyr::ByteBuffer &bb, const zephyr::PresenceBitmap &bitmap, uint32_t first, uint32_t last) const {"
+            );
+            cpp.push(
+              "  return _schema.skipDenseFields(bb, _index" + definition.name + ", bitmap, first, last);"
+            );
+            cpp.push("}");
+            cpp.push("");
+          }
         }
       }
     }
-    for (let i = 0; i < schema.definitions.length; i++) {
-      const definition = schema.definitions[i];
+    const ordered = cppDefinitionOrder(definitions, schema, compact);
+    for (let i = 0; i < ordered.length; i++) {
+      const definition = ordered[i];
       if (definition.kind === "ENUM") {
         continue;
       }
@@ -1583,12 +1869,12 @@ function compileSchemaCPP(schema) {
           if (field.isDeprecated) {
             continue;
           }
-          const type = cppType(definitions, field, field.isArray);
-          if (cppIsFieldPointer(definitions, field)) {
+          const type = cppType(definitions, field, field.isArray, compact);
+          if (cppIsFieldPointer(definitions, field, compact)) {
             cpp.push("  " + type + " *" + field.name + "();");
             cpp.push("  const " + type + " *" + field.name + "() const;");
             cpp.push("  void set_" + field.name + "(" + type + " *value);");
-          } else if (field.isArray || field.isFixedArray) {
+          } else if (field.isArray || field.isFixedArray || cppIsCompactBytes(field, compact)) {
             cpp.push("  " + type + " *" + field.name + "();");
             cpp.push("  const " + type + " *" + field.name + "() const;");
             cpp.push(
@@ -1603,15 +1889,45 @@ function compileSchemaCPP(schema) {
           }
           cpp.push("");
         }
+        if (unknownFields && definition.kind === "MESSAGE") {
+          cpp.push(
+            "  zephyr::UnknownFields &unknownFields() { return _unknownFields; }"
+          );
+          cpp.push(
+            "  const zephyr::UnknownFields &unknownFields() const { return _unknownFields; }"
+          );
+          cpp.push("");
+        }
         cpp.push("  bool encode(zephyr::ByteBuffer &bb);");
         cpp.push(
           "  bool decode(zephyr::ByteBuffer &bb, zephyr::MemoryPool &pool, const BinarySchema *schema = nullptr);"
         );
+        if (dense && definition.kind === "MESSAGE") {
+          cpp.push(
+            "  bool encodeDense(zephyr::ByteBuffer &bb, uint32_t lastDenseId = UINT32_MAX);"
+          );
+          cpp.push(
+            "  bool decodeDense(zephyr::ByteBuffer &bb, zephyr::MemoryPool &pool, const BinarySchema *schema = nullptr);"
+          );
+        }
+        if (reuse) {
+          cpp.push("");
+          cpp.push(
+            "  // Must be called before clearing the pool if this object outlives it"
+          );
+          cpp.push(
+            "  void releaseStorage() { *this = " + definition.name + "(); }"
+          );
+        }
         cpp.push("");
         cpp.push("private:");
-        cpp.push(
-          "  uint32_t _flags[" + (fields.length + 31 >> 5) + "] = {};"
-        );
+        const flags = "  " + (compact ? "uint8_t" : "uint32_t") + " _flags[" + cppFlagIndex(fields.length + cppFlagBits(compact) - 1, compact) + "] = {};";
+        if (!compact) {
+          cpp.push(flags);
+        }
+        if (unknownFields && definition.kind === "MESSAGE") {
+          cpp.push("  zephyr::UnknownFields _unknownFields;");
+        }
         const sizes = {
           bool: 1,
           byte: 1,
@@ -1622,56 +1938,77 @@ function compileSchemaCPP(schema) {
           double: 8
         };
         const sortedFields = fields.slice().sort(function(a, b) {
-          const sizeA = !a.isArray && !a.isFixedArray && sizes[a.type] || 8;
-          const sizeB = !b.isArray && !b.isFixedArray && sizes[b.type] || 8;
+          const sizeA = compact ? cppCompactAlignment(definitions, a) : !a.isArray && !a.isFixedArray && sizes[a.type] || 8;
+          const sizeB = compact ? cppCompactAlignment(definitions, b) : !b.isArray && !b.isFixedArray && sizes[b.type] || 8;
           if (sizeA !== sizeB) return sizeB - sizeA;
           return fields.indexOf(a) - fields.indexOf(b);
         });
         for (let j = 0; j < sortedFields.length; j++) {
           const field = sortedFields[j];
           if (field.isDeprecated) {
+            if (reuse && cppIsFieldObject(definitions, field)) {
+              cpp.push(
+                "  zephyr::Retained<" + cppType(definitions, field, false, compact) + "> " + cppOwnedName(field) + ";"
+              );
+            }
             continue;
           }
           const name = cppFieldName(field);
-          const type = cppType(definitions, field, field.isArray);
-          if (cppIsFieldPointer(definitions, field)) {
+          const type = cppType(definitions, field, field.isArray, compact);
+          if (cppIsFieldPointer(definitions, field, compact)) {
             cpp.push("  " + type + " *" + name + " = {};");
+            if (reuse) {
+              cpp.push(
+                "  zephyr::Retained<" + type + "> " + cppOwnedName(field) + ";"
+              );
+            }
           } else {
             cpp.push("  " + type + " " + name + " = {};");
           }
         }
+        if (compact) {
+          cpp.push(flags);
+        }
         cpp.push("};");
         cpp.push("");
       } else {
         for (let j = 0; j < fields.length; j++) {
           const field = fields[j];
           const name = cppFieldName(field);
-          const type = cppType(definitions, field, field.isArray);
-          const flagIndex = cppFlagIndex(j);
-          const flagMask = cppFlagMask(j);
+          const type = cppType(definitions, field, field.isArray, compact);
+          const flagIndex = cppFlagIndex(j, compact);
+          const flagMask = cppFlagMask(j, compact);
           if (field.isDeprecated) {
             continue;
           }
-          if (cppIsFieldPointer(definitions, field)) {
+          if (cppIsFieldPointer(definitions, field, compact)) {
+            const getter = reuse ? "  return _flags[" + flagIndex + "] & " + flagMask + " ? " + name + " : nullptr;" : "  return " + name + ";";
             cpp.push(
               type + " *" + definition.name + "::" + field.name + "() {"
             );
-            cpp.push("  return " + name + ";");
+            cpp.push(getter);
             cpp.push("}");
             cpp.push("");
             cpp.push(
               "const " + type + " *" + definition.name + "::" + field.name + "() const {"
             );
-            cpp.push("  return " + name + ";");
+            cpp.push(getter);
             cpp.push("}");
             cpp.push("");
             cpp.push(
               "void " + definition.name + "::set_" + field.name + "(" + type + " *value) {"
             );
-            cpp.push("  " + name + " = value;");
+            if (reuse) {
+              cpp.push(
+                "  _flags[" + flagIndex + "] |= " + flagMask + "; " + name + " = value;"
+              );
+            } else {
+              cpp.push("  " + name + " = value;");
+            }
             cpp.push("}");
             cpp.push("");
-          } else if (field.isArray || field.isFixedArray) {
+          } else if (field.isArray || field.isFixedArray || cppIsCompactBytes(field, compact)) {
+            const element = cppIsCompactBytes(field, compact) ? "uint8_t" : cppType(definitions, field, false, compact);
             cpp.push(
               type + " *" + definition.name + "::" + field.name + "() {"
             );
@@ -1691,9 +2028,16 @@ function compileSchemaCPP(schema) {
             cpp.push(
               type + " &" + definition.name + "::set_" + field.name + "(zephyr::MemoryPool &pool, uint32_t count) {"
             );
-            cpp.push(
-              "  _flags[" + flagIndex + "] |= " + flagMask + "; return " + name + " = pool.array<" + cppType(definitions, field, false) + ">(count);"
-            );
+            if (compact) {
+              cpp.push(
+                "  if (" + name + ".assign(pool.allocate<" + element + ">(count), count)) _flags[" + flagIndex + "] |= " + flagMask + ";"
+              );
+              cpp.push("  return " + name + ";");
+            } else {
+              cpp.push(
+                "  _flags[" + flagIndex + "] |= " + flagMask + "; return " + name + " = pool.array<" + element + ">(count);"
+              );
+            }
             cpp.push("}");
             cpp.push("");
           } else {
@@ -1723,6 +2067,8 @@ function compileSchemaCPP(schema) {
             cpp.push("");
           }
         }
+        const encodeBodies = [];
+        const decodeBodies = [];
         cpp.push(
           "bool " + definition.name + "::encode(zephyr::ByteBuffer &_bb) {"
         );
@@ -1733,8 +2079,6 @@ function compileSchemaCPP(schema) {
           }
           const name = cppFieldName(field);
           const value = field.isArray || field.isFixedArray ? "_it" : name;
-          const flagIndex = cppFlagIndex(j);
-          const flagMask = cppFlagMask(j);
           let code;
           switch (field.type) {
             case "bool": {
@@ -1792,40 +2136,41 @@ function compileSchemaCPP(schema) {
               } else if (type.kind === "ENUM") {
                 code = "_bb.writeVarUint(static_cast<uint32_t>(" + value + "));";
               } else {
-                code = "if (!" + value + (cppIsFieldPointer(definitions, field) ? "->" : ".") + "encode(_bb)) return false;";
+                code = "if (!" + value + (cppIsFieldPointer(definitions, field, compact) ? "->" : ".") + "encode(_bb)) return false;";
               }
             }
           }
-          let indent = "  ";
-          if (definition.kind === "STRUCT") {
-            cpp.push("  if (" + field.name + "() == nullptr) return false;");
-          } else {
-            cpp.push("  if (" + field.name + "() != nullptr) {");
-            indent = "    ";
-          }
-          if (definition.kind === "MESSAGE") {
-            cpp.push(indent + "_bb.writeVarUint(" + field.value + ");");
-          }
+          const body = [];
           if (field.isFixedArray && field.arraySize !== void 0) {
-            cpp.push(
-              indent + "for (uint32_t _i = 0; _i < " + field.arraySize + "; _i++) {"
+            body.push(
+              "for (uint32_t _i = 0; _i < " + field.arraySize + "; _i++) {"
             );
-            cpp.push(indent + "  " + value + " = " + name + "[_i];");
-            cpp.push(indent + "  " + code);
-            cpp.push(indent + "}");
+            body.push("  " + value + " = " + name + "[_i];");
+            body.push("  " + code);
+            body.push("}");
           } else if (field.isArray) {
-            cpp.push(indent + "_bb.writeVarUint(" + name + ".size());");
-            cpp.push(
-              indent + "for (" + cppType(definitions, field, false) + " &_it : " + name + ") " + code
+            body.push("_bb.writeVarUint(" + name + ".size());");
+            body.push(
+              "for (" + cppType(definitions, field, false, compact) + " &_it : " + name + ") " + code
             );
           } else {
-            cpp.push(indent + code);
+            body.push(code);
           }
-          if (definition.kind !== "STRUCT") {
+          encodeBodies.push({ field, body });
+          if (definition.kind === "STRUCT") {
+            cpp.push("  if (" + field.name + "() == nullptr) return false;");
+            cppPushIndented(cpp, "  ", body);
+          } else {
+            cpp.push("  if (" + field.name + "() != nullptr) {");
+            cpp.push("    _bb.writeVarUint(" + field.value + ");");
+            cppPushIndented(cpp, "    ", body);
             cpp.push("  }");
           }
         }
         if (definition.kind === "MESSAGE") {
+          if (unknownFields) {
+            cpp.push("  _unknownFields.encode(_bb);");
+          }
           cpp.push("  _bb.writeVarUint(0);");
         }
         cpp.push("  return true;");
@@ -1840,8 +2185,17 @@ function compileSchemaCPP(schema) {
             break;
           }
         }
+        if (reuse && definition.kind === "MESSAGE") {
+          cpp.push("  memset(_flags, 0, sizeof(_flags));");
+        }
+        if (unknownFields && definition.kind === "MESSAGE") {
+          cpp.push("  _unknownFields.clear();");
+        }
         if (definition.kind === "MESSAGE") {
           cpp.push("  while (true) {");
+          if (unknownFields) {
+            cpp.push("    size_t _start = _bb.index();");
+          }
           cpp.push("    uint32_t _type;");
           cpp.push("    if (!_bb.readVarUint(_type)) return false;");
           cpp.push("    switch (_type) {");
@@ -1851,8 +2205,13 @@ function compileSchemaCPP(schema) {
         for (let j = 0; j < fields.length; j++) {
           const field = fields[j];
           const name = cppFieldName(field);
-          const value = field.isArray || field.isFixedArray ? "_it" : name;
-          const isPointer = cppIsFieldPointer(definitions, field);
+          const isPointer = cppIsFieldPointer(definitions, field, compact);
+          const isOwned = isPointer && reuse && !field.isDeprecated;
+          const isDiscarded = field.isDeprecated && !cppIsFieldObject(definitions, field);
+          const isScratch = field.isDeprecated && reuse && cppIsFieldObject(definitions, field);
+          const length = "_length_" + field.name;
+          const value = isDiscarded ? name : isScratch ? cppOwnedName(field) + ".get(_pool)" : field.isArray || field.isFixedArray ? "_it" : name;
+          const isAllocated = isPointer || isScratch || field.isDeprecated && cppIsFieldInline(definitions, field, compact);
           let code;
           switch (field.type) {
             case "bool": {
@@ -1884,11 +2243,11 @@ function compileSchemaCPP(schema) {
               break;
             }
             case "string": {
-              code = "_bb.readString(" + value + ", _pool)";
+              code = isDiscarded ? "_bb.readString(" + value + ", " + length + ")" : (reuse ? "_bb.readStringInPlace(" : "_bb.readString(") + value + ", _pool)";
               break;
             }
             case "bytes": {
-              code = "_bb.readBytes(" + value + ", _length)";
+              code = isDiscarded ? "_bb.readBytes(" + value + ", " + length + ")" : (reuse && !compact ? "_bb.readBytesInPlace(" : "_bb.readBytes(") + value + ", _pool)";
               break;
             }
             case "int64": {
@@ -1910,54 +2269,111 @@ function compileSchemaCPP(schema) {
               } else if (type2.kind === "ENUM") {
                 code = "_bb.readVarUint(reinterpret_cast<uint32_t &>(" + value + "))";
               } else {
-                code = value + (isPointer ? "->" : ".") + "decode(_bb, _pool, _schema)";
+                code = value + (isAllocated ? "->" : ".") + "decode(_bb, _pool, _schema)";
               }
             }
           }
-          const type = cppType(definitions, field, false);
-          let indent = "  ";
-          if (definition.kind === "MESSAGE") {
-            cpp.push("      case " + field.value + ": {");
-            indent = "        ";
-          }
-          if (field.isFixedArray && field.arraySize !== void 0) {
-            cpp.push(
-              indent + "for (" + type + " &_it : set_" + field.name + "(_pool, " + field.arraySize + ")) if (!" + code + ") return false;"
+          const type = cppType(definitions, field, false, compact);
+          const body = [];
+          const reuseArray = (count) => {
+            body.push(
+              "if (!" + name + ".resize(" + count + ")) " + name + " = _pool.array<" + type + ">(" + count + ");"
+            );
+            body.push(
+              "_flags[" + cppFlagIndex(j, compact) + "] |= " + cppFlagMask(j, compact) + ";"
+            );
+            body.push(
+              "for (" + type + " &_it : " + name + ") if (!" + code + ") return false;"
             );
+          };
+          if (isDiscarded || isScratch) {
+            if (field.isArray) {
+              body.push("if (!_bb.readVarUint(_count)) return false;");
+            }
+            if (isDiscarded && field.type === "string") {
+              body.push("const char *" + name + ";");
+              body.push("size_t " + length + ";");
+            } else if (isDiscarded && field.type === "bytes") {
+              body.push("uint8_t *" + name + ";");
+              body.push("size_t " + length + ";");
+            } else if (isDiscarded) {
+              body.push(type + " " + name + " = {};");
+            }
+            if (field.isArray || field.isFixedArray) {
+              body.push(
+                "for (uint32_t _i = 0; _i < " + (field.isArray ? "_count" : field.arraySize) + "; _i++) if (!" + code + ") return false;"
+              );
+            } else {
+              body.push("if (!" + code + ") return false;");
+            }
+          } else if (field.isFixedArray && field.arraySize !== void 0) {
+            if (field.isDeprecated) {
+              body.push(
+                "for (" + type + " &_it : _pool.array<" + type + ">(" + field.arraySize + ")) if (!" + code + ") return false;"
+              );
+            } else if (reuse && !compact) {
+              reuseArray(field.arraySize);
+            } else {
+              body.push(
+                "for (" + type + " &_it : set_" + field.name + "(_pool, " + field.arraySize + ")) if (!" + code + ") return false;"
+              );
+            }
           } else if (field.isArray) {
-            cpp.push(indent + "if (!_bb.readVarUint(_count)) return false;");
+            body.push("if (!_bb.readVarUint(_count)) return false;");
             if (field.isDeprecated) {
-              cpp.push(
-                indent + "for (" + type + " &_it : _pool.array<" + cppType(definitions, field, false) + ">(_count)) if (!" + code + ") return false;"
+              body.push(
+                "for (" + type + " &_it : _pool.array<" + cppType(definitions, field, false, compact) + ">(_count)) if (!" + code + ") return false;"
+              );
+            } else if (compact) {
+              body.push(
+                "if (!set_" + field.name + "(_pool, _count).size() && _count) return false;"
               );
+              body.push(
+                "for (" + type + " &_it : " + name + ") if (!" + code + ") return false;"
+              );
+            } else if (reuse) {
+              reuseArray("_count");
             } else {
-              cpp.push(
-                indent + "for (" + type + " &_it : set_" + field.name + "(_pool, _count)) if (!" + code + ") return false;"
+              body.push(
+                "for (" + type + " &_it : set_" + field.name + "(_pool, _count)) if (!" + code + ") return false;"
               );
             }
           } else {
             if (field.isDeprecated) {
-              if (isPointer) {
-                cpp.push(
-                  indent + type + " *" + name + " = _pool.allocate<" + type + ">();"
+              if (isAllocated) {
+                body.push(
+                  type + " *" + name + " = _pool.allocate<" + type + ">();"
                 );
               } else {
-                cpp.push(indent + type + " " + name + " = {};");
+                body.push(type + " " + name + " = {};");
               }
-              cpp.push(indent + "if (!" + code + ") return false;");
+              body.push("if (!" + code + ") return false;");
             } else {
-              if (isPointer) {
-                cpp.push(indent + name + " = _pool.allocate<" + type + ">();");
+              if (isOwned) {
+                body.push(
+                  "set_" + field.name + "(" + cppOwnedName(field) + ".get(_pool));"
+                );
+              } else if (isPointer) {
+                body.push(name + " = _pool.allocate<" + type + ">();");
               }
-              cpp.push(indent + "if (!" + code + ") return false;");
-              if (!isPointer) {
-                cpp.push(indent + "set_" + field.name + "(" + name + ");");
+              body.push("if (!" + code + ") return false;");
+              if (cppIsCompactBytes(field, compact)) {
+                body.push(
+                  "_flags[" + cppFlagIndex(j, compact) + "] |= " + cppFlagMask(j, compact) + ";"
+                );
+              } else if (!isPointer) {
+                body.push("set_" + field.name + "(" + value + ");");
               }
             }
           }
+          decodeBodies.push({ field, body });
           if (definition.kind === "MESSAGE") {
+            cpp.push("      case " + field.value + ": {");
+            cppPushIndented(cpp, "        ", body);
             cpp.push("        break;");
             cpp.push("      }");
+          } else {
+            cppPushIndented(cpp, "  ", body);
           }
         }
         if (definition.kind === "MESSAGE") {
@@ -1965,6 +2381,11 @@ function compileSchemaCPP(schema) {
           cpp.push(
             "        if (!_schema || !_schema->skip" + definition.name + "Field(_bb, _type)) return false;"
           );
+          if (unknownFields) {
+            cpp.push(
+              "        _unknownFields.add(_bb.data() + _start, _bb.index() - _start, _pool);"
+            );
+          }
           cpp.push("        break;");
           cpp.push("      }");
           cpp.push("    }");
@@ -1974,6 +2395,17 @@ function compileSchemaCPP(schema) {
         }
         cpp.push("}");
         cpp.push("");
+        if (dense && definition.kind === "MESSAGE") {
+          cppDenseMethods(
+            cpp,
+            definition,
+            encodeBodies,
+            decodeBodies,
+            unknownFields,
+            compact,
+            reuse
+          );
+        }
       }
     }
     if (pass === 2) {
@@ -1,16 +1,144 @@
 #ifndef ZEPHYR_H
 #define ZEPHYR_H
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <initializer_list>
+#include <locale.h>
+#include <math.h>
 #include <memory.h>
+#include <mutex>
+#include <new>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace zephyr {
   class String;
   class MemoryPool;
+  class JsonTranscoder;
+  template <typename T> class Array;
+  template <typename T> class CompactArray;
+
+  /**
+   * Source of the memory behind MemoryPool chunks and ByteBuffer storage.
+   * Memory is not expected to be zeroed. Allocators must outlive the pools
+   * and buffers that use them.
+   */
+  class Allocator {
+  public:
+    virtual ~Allocator() {}
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *data, size_t size) = 0;
+
+    // MemoryPool rounds its chunks up to this, for allocators that are only
+    // worth calling for large blocks
+    virtual size_t minimumSize() const { return 0; }
+
+    // The default, backed by malloc() and free()
+    static Allocator &heap();
+  };
+
+  class HeapAllocator : public Allocator {
+  public:
+    void *allocate(size_t size) override;
+    void deallocate(void *data, size_t size) override;
+  };
+
+#ifndef _WIN32
+  /**
+   * Maps every allocation separately, optionally asking for transparent
+   * huge pages. Allocations of at least HUGE_PAGE_SIZE are aligned to it so
+   * the kernel can back them with huge pages. Every allocation is a system
+   * call, so MemoryPool chunks from it are at least HUGE_PAGE_SIZE. Put an
+   * ArenaAllocator in front of it to reserve one region up front instead.
+   */
+  class MmapAllocator : public Allocator {
+  public:
+    enum { HUGE_PAGE_SIZE = 2 << 20 };
+
+    explicit MmapAllocator(bool hugePages = true) : _hugePages(hugePages) {}
+    void *allocate(size_t size) override;
+    void deallocate(void *data, size_t size) override;
+    size_t minimumSize() const override { return HUGE_PAGE_SIZE; }
+
+  protected:
+    virtual void _advise(void *data, size_t size);
+    size_t _length(size_t size) const;
+
+    bool _hugePages = true;
+  };
+#endif
+
+#ifdef __linux__
+  /**
+   * Like MmapAllocator, but asks the kernel to place pages on one NUMA node
+   * when they are first touched. Use one per node, for example one per
+   * decoder thread pinned to that node.
+   */
+  class NumaAllocator : public MmapAllocator {
+  public:
+    explicit NumaAllocator(int node, bool hugePages = true) : MmapAllocator(hugePages), _node(node) {}
+    int node() const { return _node; }
+
+    // The node of the CPU the calling thread is running on
+    static int currentNode();
+
+  protected:
+    void _advise(void *data, size_t size) override;
+
+    int _node = 0;
+  };
+#endif
+
+  /**
+   * Carves allocations out of one region reserved up front from another
+   * allocator, so everything it hands out stays within "capacity" bytes of
+   * everything else. The region is only reused once every allocation has
+   * been returned, which is what MemoryPool::clear() does. Not thread-safe.
+   */
+  class ArenaAllocator : public Allocator {
+  public:
+    explicit ArenaAllocator(size_t capacity, Allocator &backing = Allocator::heap());
+    ~ArenaAllocator();
+    ArenaAllocator(const ArenaAllocator &) = delete;
+    ArenaAllocator &operator = (const ArenaAllocator &) = delete;
+
+    void *allocate(size_t size) override;
+    void deallocate(void *data, size_t size) override;
+
+  private:
+    enum { ALIGNMENT = 16 };
+
+    Allocator &_backing;
+    uint8_t *_data = nullptr;
+    size_t _capacity = 0;
+    size_t _used = 0;
+    size_t _live = 0;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
 
   /**
    * High-performance byte buffer with optimized memory management
@@ -18,6 +146,7 @@ namespace zephyr {
   class ByteBuffer {
   public:
     ByteBuffer();
+    explicit ByteBuffer(Allocator &allocator);
     ByteBuffer(uint8_t *data, size_t size);
     ByteBuffer(const uint8_t *data, size_t size);
     ~ByteBuffer();
@@ -39,6 +168,11 @@ namespace zephyr {
     bool readString(const char *&result, size_t &length);
     bool readString(String &result, MemoryPool &pool);
     bool readBytes(uint8_t *&result, size_t &length);
+    bool readBytes(Array<uint8_t> &result, MemoryPool &pool);
+    bool readBytes(CompactArray<uint8_t> &result, MemoryPool &pool); // Fails if the bytes end up out of reach
+    bool readStringInPlace(String &result, MemoryPool &pool); // Reuses the capacity of "result"
+    bool readBytesInPlace(Array<uint8_t> &result, MemoryPool &pool); // Reuses the capacity of "result"
+    bool readRawBytes(const uint8_t *&result, size_t length); // No length prefix
     bool readVarUint64(uint64_t &result);
     bool readVarInt64(int64_t &result);
 
@@ -52,6 +186,7 @@ namespace zephyr {
     void writeString(const char *value, size_t length);
     void writeString(const char *value);
     void writeBytes(const uint8_t *value, size_t length);
+    void writeRawBytes(const uint8_t *value, size_t length); // No length prefix
     void writeVarUint64(uint64_t value);
     void writeVarInt64(int64_t value);
 
@@ -63,11 +198,38 @@ namespace zephyr {
     void writeBits(uint8_t value, uint8_t bitCount);
     bool readBits(uint8_t &result, uint8_t bitCount);
 
+    // Scatter/gather output. Once a threshold is set, writeString() and
+    // writeBytes() payloads of at least that many bytes are referenced
+    // instead of copied, so the caller must keep them alive until the
+    // output has been written. The encoded message is then described by
+    // segments() rather than by data() and size().
+#ifdef _WIN32
+    struct Segment { void *iov_base; size_t iov_len; };
+#else
+    typedef struct iovec Segment; // Can be passed straight to writev()
+#endif
+
+    void setGatherThreshold(size_t threshold) { _gatherThreshold = threshold; }
+    size_t totalSize() const { return _size + _referencedSize; }
+
+    // Fills at most "count" segments and returns how many there are in total
+    size_t segments(Segment *result, size_t count) const;
+
   private:
+    friend class JsonTranscoder;
+
     void _growBy(size_t amount);
     void _ensureCapacity(size_t capacity);
+    void _reference(const uint8_t *data, size_t length);
+
+    struct Reference {
+      size_t offset = 0; // Position in _data where the payload belongs
+      const uint8_t *data = nullptr;
+      size_t length = 0;
+    };
 
     enum { INITIAL_CAPACITY = 256, GROWTH_FACTOR = 2 };
+    Allocator *_allocator = nullptr;
     uint8_t *_data = nullptr;
     size_t _size = 0;
     size_t _capacity = 0;
@@ -78,22 +240,46 @@ namespace zephyr {
     // Bit packing state
     uint8_t _bitBuffer = 0;
     uint8_t _bitOffset = 0;
+
+    // Scatter/gather state
+    Reference *_references = nullptr;
+    size_t _referenceCount = 0;
+    size_t _referenceCapacity = 0;
+    size_t _referencedSize = 0;
+    size_t _gatherThreshold = 0;
   };
 
   ////////////////////////////////////////////////////////////////////////////////
 
   class String {
   public:
-    String() {}
-    explicit String(const char *c_str, size_t length) : _c_str(c_str), _length(length) {}
-    explicit String(const char *c_str) : _c_str(c_str), _length(strlen(c_str)) {}
+    constexpr String() {}
+    // Lengths are limited to 32 bits like they are in the encoding
+    constexpr explicit String(const char *c_str, size_t length) : _c_str(c_str), _length((assert(length <= UINT32_MAX), static_cast<uint32_t>(length))) {}
+    explicit String(const char *c_str) : String(c_str, strlen(c_str)) {}
+
+    // A copy is a read-only view. Only the string that MemoryPool::string()
+    // returned, or the one it was moved into, keeps the room to be reused.
+    constexpr String(const String &other) : _c_str(other._c_str), _length(other._length) {}
+    String(String &&other) noexcept : _c_str(other._c_str), _length(other._length), _storage(other._storage) { other._storage = 0; }
+    String &operator = (const String &other) { if (this != &other) { _c_str = other._c_str; _length = other._length; _storage = 0; } return *this; }
+    String &operator = (String &&other) noexcept { if (this != &other) { _c_str = other._c_str; _length = other._length; _storage = other._storage; other._storage = 0; } return *this; }
 
     const char *c_str() const { return _c_str; }
     size_t length() const { return _length; }
 
+    // Only strings from MemoryPool::string() have room to be overwritten
+    size_t capacity() const { return _storage ? _storage - 1 : 0; }
+
   private:
+    friend class MemoryPool;
+    friend class ByteBuffer;
+
+    String(char *c_str, uint32_t length, uint32_t storage) : _c_str(c_str), _length(length), _storage(storage) {}
+
     const char *_c_str = nullptr;
-    size_t _length = 0;
+    uint32_t _length = 0;
+    uint32_t _storage = 0; // Writable bytes including the null terminator
   };
 
   inline bool operator == (const String &a, const String &b) {
@@ -106,15 +292,21 @@ namespace zephyr {
   template <typename T>
   class Array {
   public:
-    Array() {}
-    Array(T *data, uint32_t size) : _data(data), _size(size) {}
+    constexpr Array() {}
+    constexpr Array(T *data, uint32_t size) : _data(data), _size(size) {}
+
+    // Like String, copies are views without a capacity
+    constexpr Array(const Array &other) : _data(other._data), _size(other._size) {}
+    Array(Array &&other) noexcept : _data(other._data), _size(other._size), _capacity(other._capacity) { other._capacity = 0; }
+    Array &operator = (const Array &other) { if (this != &other) { _data = other._data; _size = other._size; _capacity = 0; } return *this; }
+    Array &operator = (Array &&other) noexcept { if (this != &other) { _data = other._data; _size = other._size; _capacity = other._capacity; other._capacity = 0; } return *this; }
 
     T *data() { return _data; }
     T *begin() { return _data; }
     T *end() { return _data + _size; }
     uint32_t size() const { return _size; }
     T &operator [] (uint32_t index) { assert(index < _size); return _data[index]; }
-    void set(const T *data, size_t size) { assert(size == _size); memcpy(_data, data, (size < _size ? size : _size) * sizeof(T)); }
+    void set(const T *data, size_t size) { assert(size == _size); std::copy(data, data + (size < _size ? size : _size), _data); }
     void set(const std::initializer_list<T> &data) { set(data.begin(), data.size()); }
 
     const T *data() const { return _data; }
@@ -122,9 +314,73 @@ namespace zephyr {
     const T *end() const { return _data + _size; }
     const T &operator [] (uint32_t index) const { assert(index < _size); return _data[index]; }
 
+    // Only arrays from MemoryPool::array() have a capacity. resize() keeps
+    // the elements in place and fails when the new size doesn't fit.
+    uint32_t capacity() const { return _capacity; }
+    bool resize(uint32_t size) { if (size > _capacity) return false; _size = size; return true; }
+
   private:
+    friend class MemoryPool;
+
     T *_data = nullptr;
     uint32_t _size = 0;
+    uint32_t _capacity = 0;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  /**
+   * Array that refers to its elements with a 32-bit offset from itself
+   * instead of a pointer, as generated by "zephyrc --cpp-compact". The
+   * elements must be within 2 GiB of the array, which always holds when
+   * both come from a pool backed by an ArenaAllocator of at most that size.
+   * assign() leaves the array empty and returns false if the distance
+   * doesn't fit. Copies have no way to report that, so they abort instead,
+   * in release builds too.
+   */
+  template <typename T>
+  class CompactArray {
+  public:
+    CompactArray() {}
+    CompactArray(const CompactArray &other) { _copy(other); }
+    CompactArray &operator = (const CompactArray &other) { _copy(other); return *this; }
+
+    bool assign(T *data, uint32_t size) {
+      int64_t offset = (int64_t)(reinterpret_cast<uintptr_t>(data) - reinterpret_cast<uintptr_t>(this));
+      if (!data || !size || offset != (int32_t)offset) {
+        _offset = 0;
+        _size = 0;
+        return !size;
+      }
+      _offset = (int32_t)offset;
+      _size = size;
+      return true;
+    }
+
+    T *data() { return _size ? reinterpret_cast<T *>(reinterpret_cast<uintptr_t>(this) + _offset) : nullptr; }
+    T *begin() { return data(); }
+    T *end() { return data() + _size; }
+    uint32_t size() const { return _size; }
+    T &operator [] (uint32_t index) { assert(index < _size); return data()[index]; }
+    void set(const T *data, size_t size) { assert(size == _size); std::copy(data, data + (size < _size ? size : _size), this->data()); }
+    void set(const std::initializer_list<T> &data) { set(data.begin(), data.size()); }
+
+    const T *data() const { return _size ? reinterpret_cast<const T *>(reinterpret_cast<uintptr_t>(this) + _offset) : nullptr; }
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + _size; }
+    const T &operator [] (uint32_t index) const { assert(index < _size); return data()[index]; }
+
+  private:
+    void _copy(const CompactArray &other) {
+      // Quietly ending up empty would lose the elements
+      if (!assign(const_cast<T *>(other.data()), other.size())) {
+        fprintf(stderr, "zephyr: CompactArray copied too far from its elements\n");
+        abort();
+      }
+    }
+
+    int32_t _offset = 0;
+    uint32_t _size = 0;
   };
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -134,7 +390,8 @@ namespace zephyr {
    */
   class MemoryPool {
   public:
-    MemoryPool() {}
+    constexpr MemoryPool() {}
+    constexpr explicit MemoryPool(Allocator &allocator, uint32_t chunkSize = INITIAL_CAPACITY) : _allocator(&allocator), _chunkSize(chunkSize) {}
     ~MemoryPool() { clear(); }
     MemoryPool(const MemoryPool &) = delete;
     MemoryPool &operator = (const MemoryPool &) = delete;
@@ -145,7 +402,7 @@ namespace zephyr {
     T *allocate(uint32_t count = 1);
 
     template <typename T>
-    Array<T> array(uint32_t size) { return Array<T>(allocate<T>(size), size); }
+    Array<T> array(uint32_t size) { Array<T> result(allocate<T>(size), size); result._capacity = size; return result; }
 
     String string(const char *data, uint32_t count);
     String string(const char *c_str) { return string(c_str, strlen(c_str)); }
@@ -153,6 +410,8 @@ namespace zephyr {
   private:
     enum { INITIAL_CAPACITY = 1 << 14 }; // Larger initial chunk for better performance
 
+    uint8_t *_allocate(uint32_t size, uint32_t alignment);
+
     struct Chunk {
       uint8_t *data = nullptr;
       uint32_t capacity = 0;
@@ -160,19 +419,112 @@ namespace zephyr {
       Chunk *next = nullptr;
     };
 
+    Allocator *_allocator = nullptr; // Defaults to Allocator::heap()
+    uint32_t _chunkSize = INITIAL_CAPACITY;
     Chunk *_first = nullptr;
     Chunk *_last = nullptr;
   };
 
   ////////////////////////////////////////////////////////////////////////////////
 
+  /**
+   * Object that a message generated with "zephyrc --cpp-reuse" allocates once
+   * and decodes into every time. Copies start out without one, so decoding
+   * into a copy never overwrites the original's object.
+   */
+  template <typename T>
+  class Retained {
+  public:
+    constexpr Retained() {}
+    Retained(const Retained &) {}
+    Retained &operator = (const Retained &) { _object = nullptr; return *this; }
+
+    T *get(MemoryPool &pool) { if (!_object) _object = pool.allocate<T>(); return _object; }
+
+  private:
+    T *_object = nullptr;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  /**
+   * Fields that a generated message did not recognize while decoding, kept
+   * as views of the encoded bytes (id and value) so that encode() can write
+   * them back unchanged. The decoded buffer must outlive the message.
+   */
+  class UnknownFields {
+  public:
+    bool empty() const { return _first == nullptr; }
+    void clear() { _first = _last = nullptr; }
+    void add(const uint8_t *data, size_t size, MemoryPool &pool);
+    void encode(ByteBuffer &bb) const;
+
+  private:
+    struct Range {
+      const uint8_t *data = nullptr;
+      size_t size = 0;
+      Range *next = nullptr;
+    };
+
+    Range *_first = nullptr;
+    Range *_last = nullptr;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  /**
+   * Leading part of a densely encoded message (see "zephyrc --cpp-dense"):
+   * a bit count followed by that many bits rounded up to whole bytes, where
+   * bit "id - 1" is set when the field with that id follows. The bits are
+   * a view of the decoded buffer.
+   */
+  class PresenceBitmap {
+  public:
+    uint32_t count() const { return _count; }
+    bool has(uint32_t id) const { return id - 1 < _count && (_bits[(id - 1) >> 3] >> ((id - 1) & 7) & 1); }
+
+    // Returns true if any field with an id of at least "first" is present
+    bool any(uint32_t first) const;
+    bool read(ByteBuffer &bb);
+
+  private:
+    const uint8_t *_bits = nullptr;
+    uint32_t _count = 0;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+
   class BinarySchema {
   public:
+    struct Definition;
+
+    constexpr BinarySchema() {}
+
+    // Wraps tables that were resolved at compile time (see "zephyrc --cpp").
+    // Nothing is copied, so the tables must outlive the schema.
+    constexpr BinarySchema(const Definition *definitions, uint32_t count) : _definitions(definitions, count) {}
+
     bool parse(ByteBuffer &bb);
     bool findDefinition(const char *definition, uint32_t &index) const;
+    const Array<const Definition> &definitions() const { return _definitions; }
     bool skipField(ByteBuffer &bb, uint32_t definition, uint32_t field) const;
 
-  private:
+    // Skips the values of the fields in [first, last) that are present in
+    // the bitmap of a densely encoded message
+    bool skipDenseFields(ByteBuffer &bb, uint32_t definition, const PresenceBitmap &bitmap, uint32_t first, uint32_t last) const;
+
+    // Locates the last occurrence of a top-level field of an encoded message
+    // by skipping over the others. [start, end) covers the id and the value,
+    // or is the empty range at the terminating zero if the field is absent.
+    bool findField(ByteBuffer &bb, uint32_t definition, uint32_t field, size_t &start, size_t &end) const;
+
+    // Writes the message with one top-level field replaced, or appended if
+    // it was absent, without decoding anything else. "value" is the encoded
+    // value without its id. With a gather threshold set on "out", the
+    // unchanged parts are referenced instead of copied.
+    bool patchField(const uint8_t *data, size_t size, uint32_t definition, uint32_t field,
+      const uint8_t *value, size_t length, ByteBuffer &out) const;
+
     enum {
       TYPE_BOOL = -1,
       TYPE_BYTE = -2,
@@ -188,6 +540,10 @@ namespace zephyr {
     };
 
     struct Field {
+      constexpr Field() {}
+      constexpr Field(String name, int32_t type, bool isArray, bool isFixedArray, bool isMap, uint32_t arraySize, int32_t keyType, uint32_t value)
+        : name(name), type(type), isArray(isArray), isFixedArray(isFixedArray), isMap(isMap), arraySize(arraySize), keyType(keyType), value(value) {}
+
       String name;
       int32_t type = 0;
       bool isArray = false;
@@ -205,140 +561,787 @@ namespace zephyr {
     };
 
     struct Definition {
+      constexpr Definition() {}
+      constexpr Definition(String name, uint8_t kind, Array<const Field> fields) : name(name), kind(kind), fields(fields) {}
+
       String name;
       uint8_t kind = 0;
-      Array<Field> fields;
+      Array<const Field> fields;
     };
 
+  private:
     bool _skipField(ByteBuffer &bb, const Field &field) const;
 
     MemoryPool _pool;
-    Array<Definition> _definitions;
+    Array<const Definition> _definitions;
   };
-}
 
-#endif
+  ////////////////////////////////////////////////////////////////////////////////
 
-#ifdef IMPLEMENT_ZEPHYR_H
-#ifndef IMPLEMENT_ZEPHYR_H_
-#define IMPLEMENT_ZEPHYR_H_
+  /**
+   * Converts between encoded values and JSON by walking the definitions of a
+   * BinarySchema, so tools can handle types they weren't compiled with. The
+   * mapping matches "zephyrc --to-json": messages become objects with their
+   * present fields, structs objects with every field, enums member names,
+   * 64-bit integers strings, bytes arrays of numbers and map keys strings.
+   * Non-finite floats become null. Both directions write straight into the
+   * output buffer without building intermediate values.
+   */
+  class JsonTranscoder {
+  public:
+    explicit JsonTranscoder(const BinarySchema &schema) : _schema(schema) {}
 
-  zephyr::ByteBuffer::ByteBuffer() : _data(new uint8_t[INITIAL_CAPACITY]), _capacity(INITIAL_CAPACITY), _ownsData(true) {
-  }
+    bool toJson(ByteBuffer &bb, uint32_t definition, ByteBuffer &out) const;
 
-  zephyr::ByteBuffer::ByteBuffer(uint8_t *data, size_t size) : _data(data), _size(size), _capacity(size) {
-  }
+    // Keys that aren't fields and null message fields are ignored, like in
+    // the generated JavaScript. Struct fields may appear in any order.
+    bool fromJson(const char *json, size_t length, uint32_t definition, ByteBuffer &out) const;
 
-  zephyr::ByteBuffer::ByteBuffer(const uint8_t *data, size_t size) : _data(const_cast<uint8_t *>(data)), _size(size), _capacity(size), _isConst(true) {
-    (void)_isConst;
-  }
+  private:
+    typedef BinarySchema::Field Field;
+    typedef BinarySchema::Definition Definition;
 
-  zephyr::ByteBuffer::~ByteBuffer() {
-    if (_ownsData) {
-      delete [] _data;
+    struct Input {
+      const char *data = nullptr;
+      const char *end = nullptr;
+      MemoryPool *scratch = nullptr; // For structs with fields out of order
+    };
+
+    enum { MAX_DEPTH = 256 };
+
+    bool _toJsonDefinition(ByteBuffer &bb, uint32_t definition, ByteBuffer &out, uint32_t depth) const;
+    bool _toJsonField(ByteBuffer &bb, const Field &field, ByteBuffer &out, uint32_t depth) const;
+    bool _toJsonValue(ByteBuffer &bb, int32_t type, ByteBuffer &out, uint32_t depth) const;
+    bool _toJsonKey(ByteBuffer &bb, int32_t type, ByteBuffer &out) const;
+
+    bool _fromJsonDefinition(Input &in, uint32_t definition, ByteBuffer &out, uint32_t depth) const;
+    bool _fromJsonField(Input &in, const Field &field, ByteBuffer &out, uint32_t depth) const;
+    bool _fromJsonValue(Input &in, int32_t type, ByteBuffer &out, uint32_t depth) const;
+    bool _fromJsonKey(Input &in, int32_t type, ByteBuffer &out) const;
+
+    const Field *_findField(const Definition &definition, uint32_t id) const;
+    const Field *_findField(const Definition &definition, const char *name, size_t length, uint32_t hint) const;
+
+    static void _write(ByteBuffer &out, const char *data, size_t length);
+    static void _writeUint64(ByteBuffer &out, uint64_t value);
+    static void _writeInt64(ByteBuffer &out, int64_t value);
+    static void _writeFloat(ByteBuffer &out, double value, bool isSingle);
+    static void _writeString(ByteBuffer &out, const char *data, size_t length);
+    static size_t _beginCount(ByteBuffer &out);
+    static void _endCount(ByteBuffer &out, size_t start, uint32_t count);
+
+    static void _skipSpace(Input &in);
+    static bool _expect(Input &in, char c);
+    static bool _expectLiteral(Input &in, const char *literal, size_t length);
+    static bool _readRawString(Input &in, const char *&data, size_t &length, bool &isEscaped);
+    static bool _readHex(const char *data, uint32_t &result); // Exactly four digits
+    static bool _readString(Input &in, ByteBuffer &out);
+    static bool _readInteger(Input &in, bool &isNegative, uint64_t &magnitude);
+    static bool _readFloat(Input &in, double &result);
+    static bool _skipValue(Input &in);
+
+    const BinarySchema &_schema;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  /**
+   * Thread-safe registry of immutable parsed schemas keyed by content hash.
+   * S is zephyr::BinarySchema or a generated BinarySchema class. Readers
+   * never lock: published schemas are never modified or freed while the
+   * registry is alive, so pointers from find() and current() stay valid
+   * without reference counting. Loading bytes that were already loaded
+   * returns the existing schema instead of parsing them again.
+   */
+  template <typename S>
+  class SchemaRegistry {
+  public:
+    SchemaRegistry() {}
+    ~SchemaRegistry() {
+      for (Entry *entry = _head.load(std::memory_order_relaxed), *next; entry; entry = next) {
+        next = entry->next;
+        delete [] entry->data;
+        delete entry;
+      }
     }
-  }
+    SchemaRegistry(const SchemaRegistry &) = delete;
+    SchemaRegistry &operator = (const SchemaRegistry &) = delete;
 
-  void zephyr::ByteBuffer::_ensureCapacity(size_t capacity) {
-    if (capacity > _capacity) {
-      size_t newCapacity = capacity * GROWTH_FACTOR;
-      uint8_t *data = new uint8_t[newCapacity];
-      memcpy(data, _data, _size);
+    static uint64_t hash(const uint8_t *data, size_t size);
 
-      if (_ownsData) {
-        delete [] _data;
+    // Parses and publishes a schema, and makes it the current one. Returns
+    // nullptr if the schema is invalid, in which case nothing changes.
+    const S *load(const uint8_t *data, size_t size);
+
+    const S *find(uint64_t hash) const {
+      for (Entry *entry = _head.load(std::memory_order_acquire); entry; entry = entry->next) {
+        if (entry->hash == hash) return &entry->schema;
       }
+      return nullptr;
+    }
 
-      _data = data;
-      _capacity = newCapacity;
-      _ownsData = true;
+    const S *current() const {
+      Entry *entry = _current.load(std::memory_order_acquire);
+      return entry ? &entry->schema : nullptr;
     }
-  }
 
-  void zephyr::ByteBuffer::_growBy(size_t amount) {
-    assert(!_isConst);
-    _ensureCapacity(_size + amount);
-    _size += amount;
-  }
+    // Starts at 1 for the first distinct schema and increases by one for
+    // every new one. Reloading an older schema brings back its version.
+    uint32_t version() const {
+      Entry *entry = _current.load(std::memory_order_acquire);
+      return entry ? entry->version : 0;
+    }
 
-  bool zephyr::ByteBuffer::readByte(bool &result) {
-    uint8_t value;
-    if (!readByte(value)) {
-      result = false;
-      return false;
+  private:
+    struct Entry {
+      uint64_t hash = 0;
+      uint32_t version = 0;
+      uint8_t *data = nullptr;
+      size_t size = 0;
+      S schema;
+      Entry *next = nullptr;
+    };
+
+    std::atomic<Entry *> _head{nullptr};
+    std::atomic<Entry *> _current{nullptr};
+    std::mutex _mutex;
+  };
+
+  // Defined here rather than under IMPLEMENT_ZEPHYR_H so every translation
+  // unit that instantiates the registry has them
+  template <typename S>
+  uint64_t SchemaRegistry<S>::hash(const uint8_t *data, size_t size) {
+    // 64-bit FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ data[i]) * 0x100000001b3ULL;
     }
-    result = value != 0;
-    return true;
+    return hash;
   }
 
-  bool zephyr::ByteBuffer::readByte(uint8_t &result) {
-    if (_index >= _size) {
-      result = 0;
-      return false;
+  template <typename S>
+  const S *SchemaRegistry<S>::load(const uint8_t *data, size_t size) {
+    uint64_t key = hash(data, size);
+    std::lock_guard<std::mutex> lock(_mutex);
+    Entry *head = _head.load(std::memory_order_relaxed);
+    uint32_t version = head ? head->version + 1 : 1;
+
+    for (Entry *entry = head; entry; entry = entry->next) {
+      if (entry->hash == key && entry->size == size && !memcmp(entry->data, data, size)) {
+        _current.store(entry, std::memory_order_release);
+        return &entry->schema;
+      }
     }
-    result = _data[_index];
-    _index++;
-    return true;
+
+    // Keep a copy of the bytes to compare against later loads
+    Entry *entry = new Entry;
+    entry->hash = key;
+    entry->version = version;
+    entry->data = new uint8_t[size];
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    ByteBuffer bb(static_cast<const uint8_t *>(entry->data), size);
+    if (!entry->schema.parse(bb)) {
+      delete [] entry->data;
+      delete entry;
+      return nullptr;
+    }
+
+    entry->next = head;
+    _head.store(entry, std::memory_order_release);
+    _current.store(entry, std::memory_order_release);
+    return &entry->schema;
   }
 
-  bool zephyr::ByteBuffer::readVarFloat(float &result) {
-    uint8_t first;
-    if (!readByte(first)) {
-      return false;
+  ////////////////////////////////////////////////////////////////////////////////
+
+  /**
+   * Encodes existing types without generated code. Describe a type once at
+   * global scope with ZEPHYR_MESSAGE() and the ids of its members, or with
+   * ZEPHYR_STRUCT() and its members in schema order:
+   *
+   *   ZEPHYR_MESSAGE(Order) {
+   *     ZEPHYR_FIELD(1, id);
+   *     ZEPHYR_FIELD(2, items);
+   *   }
+   *
+   *   ZEPHYR_STRUCT(Item) {
+   *     ZEPHYR_MEMBER(sku);
+   *     ZEPHYR_MEMBER(count);
+   *   }
+   *
+   * Members can be bool, uint8_t (byte), int32_t, uint32_t, int64_t,
+   * uint64_t, float, double, std::string, enums, other described types and
+   * std::vector of any of those, with std::vector<uint8_t> as bytes. The
+   * wire format matches the generated classes, except that members have no
+   * presence so every message field is written. Message members missing from
+   * the input are reset, so decoding into a used object gives the same result
+   * as decoding into a new one. Specialize Codec, with encode(), decode() and
+   * reset(), for other member types.
+   */
+  template <typename T>
+  struct Traits;
+
+  template <typename T, typename Enable = void>
+  struct Codec {
+    static void encode(ByteBuffer &bb, const T &value) {
+      Encoder encoder = { bb };
+      Traits<T>::fields(value, encoder);
+      if (Traits<T>::kind == BinarySchema::KIND_MESSAGE) {
+        bb.writeVarUint(0);
+      }
     }
 
-    if (first == 0) {
-      result = 0;
+    // Message fields that aren't described are skipped with the schema, in
+    // which the definition has the name the type was described with
+    static bool decode(ByteBuffer &bb, T &value, const BinarySchema *schema) {
+      if (Traits<T>::kind == BinarySchema::KIND_STRUCT) {
+        StructDecoder decoder = { bb, schema, true };
+        Traits<T>::fields(value, decoder);
+        return decoder.ok;
+      }
+
+      // Members that are read keep their storage, so vectors and strings
+      // are overwritten in place, and only missing ones are reset at the end.
+      // Members past the first 64 have no bit to be tracked by and are reset
+      // up front instead.
+      Resetter early = { 0, MAX_TRACKED, UINT32_MAX, 0 };
+      Traits<T>::fields(value, early);
+
+      // Encoders write fields in id order, so a single pass over the members
+      // usually reads all of them. Passes that read nothing mean the next
+      // field isn't described.
+      MessageDecoder decoder = { bb, schema, 0, 0, 0, false, true };
+      uint32_t definition = UINT32_MAX;
+      if (!bb.readVarUint(decoder.id)) return false;
+      while (decoder.id) {
+        decoder.index = 0;
+        decoder.found = false;
+        Traits<T>::fields(value, decoder);
+        if (!decoder.ok) return false;
+        if (!decoder.found && (!_skip(bb, decoder.id, schema, definition) || !bb.readVarUint(decoder.id))) return false;
+      }
+
+      Resetter missing = { decoder.decoded, 0, MAX_TRACKED, 0 };
+      Traits<T>::fields(value, missing);
       return true;
     }
 
-    if (_index + 3 > _size) {
-      result = 0;
-      return false;
+    // Strings and vectors are cleared rather than freed
+    static void reset(T &value) {
+      Resetter resetter = { 0, 0, UINT32_MAX, 0 };
+      Traits<T>::fields(value, resetter);
     }
-    uint32_t bits = first | (_data[_index] << 8) | (_data[_index + 1] << 16) | (_data[_index + 2] << 24);
-    _index += 3;
 
-    bits = (bits << 23) | (bits >> 9);
-    memcpy(&result, &bits, 4);
-    return true;
-  }
+  private:
+    struct Encoder {
+      ByteBuffer &bb;
 
-  bool zephyr::ByteBuffer::readVarFloat16(float &result) {
-    if (_index + 2 > _size) {
-      result = 0;
-      return false;
-    }
+      template <typename F>
+      void operator () (uint32_t id, const F &field) {
+        if (Traits<T>::kind == BinarySchema::KIND_MESSAGE) bb.writeVarUint(id);
+        Codec<F>::encode(bb, field);
+      }
+    };
 
-    uint16_t half = _data[_index] | (_data[_index + 1] << 8);
-    _index += 2;
+    struct StructDecoder {
+      ByteBuffer &bb;
+      const BinarySchema *schema;
+      bool ok;
 
-    // Convert half-precision to single-precision
-    uint32_t sign = (half >> 15) & 0x1;
-    uint32_t exp = (half >> 10) & 0x1F;
-    uint32_t mantissa = half & 0x3FF;
+      template <typename F>
+      void operator () (uint32_t, F &field) {
+        ok = ok && Codec<F>::decode(bb, field, schema);
+      }
+    };
 
-    if (exp == 0) {
-      if (mantissa == 0) {
-        result = sign ? -0.0f : 0.0f;
-      } else {
-        // Denormalized
-        uint32_t bits = (sign << 31) | ((exp + 112) << 23) | (mantissa << 13);
-        memcpy(&result, &bits, 4);
+    enum { MAX_TRACKED = 64 };
+
+    struct MessageDecoder {
+      ByteBuffer &bb;
+      const BinarySchema *schema;
+      uint64_t decoded; // Bit per member position
+      uint32_t index; // Position of the member being visited
+      uint32_t id; // Of the next field, or 0 at the end of the message
+      bool found;
+      bool ok;
+
+      template <typename F>
+      void operator () (uint32_t fieldId, F &field) {
+        if (fieldId == id && ok) {
+          found = true;
+          if (index < MAX_TRACKED) decoded |= uint64_t(1) << index;
+          ok = Codec<F>::decode(bb, field, schema) && bb.readVarUint(id);
+        }
+        index++;
       }
-    } else if (exp == 31) {
-      // Infinity or NaN
-      uint32_t bits = (sign << 31) | 0x7F800000 | (mantissa << 13);
-      memcpy(&result, &bits, 4);
-    } else {
-      uint32_t bits = (sign << 31) | ((exp + 112) << 23) | (mantissa << 13);
-      memcpy(&result, &bits, 4);
-    }
-    return true;
-  }
+    };
 
-  bool zephyr::ByteBuffer::readDouble(double &result) {
-    if (_index + 8 > _size) {
+    // Resets the members in positions [begin, end) without a bit in "keep"
+    struct Resetter {
+      uint64_t keep;
+      uint32_t begin;
+      uint32_t end;
+      uint32_t index;
+
+      template <typename F>
+      void operator () (uint32_t, F &field) {
+        if (index >= begin && index < end && (index >= MAX_TRACKED || !(keep >> index & 1))) {
+          Codec<F>::reset(field);
+        }
+        index++;
+      }
+    };
+
+    // "definition" is UINT32_MAX until the first unknown field looks it up
+    static bool _skip(ByteBuffer &bb, uint32_t id, const BinarySchema *schema, uint32_t &definition) {
+      if (!schema) return false;
+
+      if (definition == UINT32_MAX) {
+        const char *name = Traits<T>::name();
+
+        // Namespaces aren't part of schema names
+        for (const char *c = name; *c; c++) {
+          if (*c == ':') name = c + 1;
+        }
+
+        if (!schema->findDefinition(name, definition)) return false;
+      }
+
+      return schema->skipField(bb, definition, id);
+    }
+  };
+
+  template <typename T>
+  struct Codec<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    static void encode(ByteBuffer &bb, T value) { bb.writeVarUint(static_cast<uint32_t>(value)); }
+    static bool decode(ByteBuffer &bb, T &value, const BinarySchema *) {
+      uint32_t result;
+      if (!bb.readVarUint(result)) return false;
+      value = static_cast<T>(result);
+      return true;
+    }
+    static void reset(T &value) { value = T(); }
+  };
+
+#define ZEPHYR_CODEC_(Type, write, read) \
+  template <> \
+  struct Codec<Type> { \
+    static void encode(ByteBuffer &bb, Type value) { bb.write(value); } \
+    static bool decode(ByteBuffer &bb, Type &value, const BinarySchema *) { return bb.read(value); } \
+    static void reset(Type &value) { value = Type(); } \
+  };
+
+  ZEPHYR_CODEC_(bool, writeByte, readByte)
+  ZEPHYR_CODEC_(uint8_t, writeByte, readByte)
+  ZEPHYR_CODEC_(int32_t, writeVarInt, readVarInt)
+  ZEPHYR_CODEC_(uint32_t, writeVarUint, readVarUint)
+  ZEPHYR_CODEC_(int64_t, writeVarInt64, readVarInt64)
+  ZEPHYR_CODEC_(uint64_t, writeVarUint64, readVarUint64)
+  ZEPHYR_CODEC_(float, writeVarFloat, readVarFloat)
+  ZEPHYR_CODEC_(double, writeDouble, readDouble)
+
+#undef ZEPHYR_CODEC_
+
+  template <>
+  struct Codec<std::string> {
+    static void encode(ByteBuffer &bb, const std::string &value) { bb.writeString(value.data(), value.size()); }
+    static bool decode(ByteBuffer &bb, std::string &value, const BinarySchema *) {
+      const char *data;
+      size_t length;
+      if (!bb.readString(data, length)) return false;
+      value.assign(data, length);
+      return true;
+    }
+    static void reset(std::string &value) { value.clear(); }
+  };
+
+  template <>
+  struct Codec<std::vector<uint8_t>> {
+    static void encode(ByteBuffer &bb, const std::vector<uint8_t> &value) { bb.writeBytes(value.data(), value.size()); }
+    static bool decode(ByteBuffer &bb, std::vector<uint8_t> &value, const BinarySchema *) {
+      uint8_t *data;
+      size_t length;
+      if (!bb.readBytes(data, length)) return false;
+      value.assign(data, data + length);
+      return true;
+    }
+    static void reset(std::vector<uint8_t> &value) { value.clear(); }
+  };
+
+  template <typename T>
+  struct Codec<std::vector<T>> {
+    static void encode(ByteBuffer &bb, const std::vector<T> &value) {
+      bb.writeVarUint(value.size());
+      for (size_t i = 0; i < value.size(); i++) {
+        Codec<T>::encode(bb, value[i]);
+      }
+    }
+
+    // Elements already in the vector are decoded over, keeping their own
+    // storage. The count is checked against the remaining bytes so corrupt
+    // input can't make it allocate without bound.
+    static bool decode(ByteBuffer &bb, std::vector<T> &value, const BinarySchema *schema) {
+      uint32_t count;
+      if (!bb.readVarUint(count) || count > bb.size() - bb.index()) return false;
+      value.resize(count);
+      for (auto &item : value) {
+        if (!Codec<T>::decode(bb, item, schema)) return false;
+      }
+      return true;
+    }
+
+    static void reset(std::vector<T> &value) { value.clear(); }
+  };
+
+  template <>
+  struct Codec<std::vector<bool>> {
+    static void encode(ByteBuffer &bb, const std::vector<bool> &value) {
+      bb.writeVarUint(value.size());
+      for (size_t i = 0; i < value.size(); i++) {
+        bb.writeByte(value[i]);
+      }
+    }
+
+    static bool decode(ByteBuffer &bb, std::vector<bool> &value, const BinarySchema *) {
+      uint32_t count;
+      bool item;
+      if (!bb.readVarUint(count) || count > bb.size() - bb.index()) return false;
+      value.resize(count);
+      for (size_t i = 0; i < value.size(); i++) {
+        if (!bb.readByte(item)) return false;
+        value[i] = item;
+      }
+      return true;
+    }
+
+    static void reset(std::vector<bool> &value) { value.clear(); }
+  };
+
+  template <typename T>
+  void encode(ByteBuffer &bb, const T &value) {
+    Codec<T>::encode(bb, value);
+  }
+
+  template <typename T>
+  bool decode(ByteBuffer &bb, T &value, const BinarySchema *schema = nullptr) {
+    return Codec<T>::decode(bb, value, schema);
+  }
+}
+
+// Describes a type for zephyr::encode() and zephyr::decode(). Must be used
+// at global scope and followed by the ZEPHYR_FIELD() or ZEPHYR_MEMBER()
+// list in braces.
+#define ZEPHYR_MESSAGE(Type) ZEPHYR_TRAITS_(Type, zephyr::BinarySchema::KIND_MESSAGE)
+#define ZEPHYR_STRUCT(Type) ZEPHYR_TRAITS_(Type, zephyr::BinarySchema::KIND_STRUCT)
+#define ZEPHYR_FIELD(id, member) _visitor(id, _value.member)
+#define ZEPHYR_MEMBER(member) _visitor(0, _value.member)
+
+#define ZEPHYR_TRAITS_(Type, Kind) \
+  namespace zephyr { \
+    template <> \
+    struct Traits<Type> { \
+      static const uint8_t kind = Kind; \
+      static const char *name() { return #Type; } \
+      template <typename Value, typename Visitor> \
+      static void fields(Value &_value, Visitor &_visitor); \
+    }; \
+  } \
+  template <typename Value, typename Visitor> \
+  void zephyr::Traits<Type>::fields(Value &_value, Visitor &_visitor)
+
+#endif
+
+#ifdef IMPLEMENT_ZEPHYR_H
+#ifndef IMPLEMENT_ZEPHYR_H_
+#define IMPLEMENT_ZEPHYR_H_
+
+  zephyr::Allocator &zephyr::Allocator::heap() {
+    // Never destroyed, so pools and buffers in static objects can still give
+    // their memory back at exit
+    static HeapAllocator *allocator = new HeapAllocator;
+    return *allocator;
+  }
+
+  void *zephyr::HeapAllocator::allocate(size_t size) {
+    void *data = malloc(size ? size : 1);
+    if (!data) {
+      throw std::bad_alloc();
+    }
+    return data;
+  }
+
+  void zephyr::HeapAllocator::deallocate(void *data, size_t) {
+    free(data);
+  }
+
+#ifndef _WIN32
+  size_t zephyr::MmapAllocator::_length(size_t size) const {
+    size_t page = _hugePages && size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 4096;
+    return (size + page - 1) & ~(page - 1);
+  }
+
+  void *zephyr::MmapAllocator::allocate(size_t size) {
+    size_t length = _length(size ? size : 1);
+    size_t alignment = length >= HUGE_PAGE_SIZE && _hugePages ? HUGE_PAGE_SIZE : 0;
+
+    // Over-allocate and trim to get huge page alignment
+    void *mapped = mmap(nullptr, length + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+
+    uint8_t *data = static_cast<uint8_t *>(mapped);
+    if (alignment) {
+      size_t head = (alignment - reinterpret_cast<uintptr_t>(data) % alignment) % alignment;
+      if (head) munmap(data, head);
+      munmap(data + head + length, alignment - head);
+      data += head;
+    }
+
+    _advise(data, length);
+    return data;
+  }
+
+  void zephyr::MmapAllocator::deallocate(void *data, size_t size) {
+    munmap(data, _length(size ? size : 1));
+  }
+
+  void zephyr::MmapAllocator::_advise(void *data, size_t size) {
+#ifdef MADV_HUGEPAGE
+    if (_hugePages) {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+#else
+    (void)data;
+    (void)size;
+#endif
+  }
+#endif
+
+  zephyr::ArenaAllocator::ArenaAllocator(size_t capacity, Allocator &backing) : _backing(backing), _capacity(capacity) {
+    _data = static_cast<uint8_t *>(backing.allocate(capacity));
+  }
+
+  zephyr::ArenaAllocator::~ArenaAllocator() {
+    assert(!_live);
+    _backing.deallocate(_data, _capacity);
+  }
+
+  void *zephyr::ArenaAllocator::allocate(size_t size) {
+    size_t index = (_used + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if (index > _capacity || size > _capacity - index) {
+      throw std::bad_alloc();
+    }
+    _used = index + size;
+    _live++;
+    return _data + index;
+  }
+
+  void zephyr::ArenaAllocator::deallocate(void *, size_t) {
+    assert(_live);
+    if (!--_live) {
+      _used = 0;
+    }
+  }
+
+#ifdef __linux__
+  int zephyr::NumaAllocator::currentNode() {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+      return 0;
+    }
+    return node;
+  }
+
+  void zephyr::NumaAllocator::_advise(void *data, size_t size) {
+    MmapAllocator::_advise(data, size);
+
+    // mbind(MPOL_PREFERRED) without depending on libnuma. Falling back to
+    // other nodes beats failing when this one runs out of memory.
+    enum { MPOL_PREFERRED_ = 1, BITS = 8 * sizeof(unsigned long) };
+    unsigned long mask[1024 / BITS] = {};
+    if (_node >= 0 && _node < 1024) {
+      mask[_node / BITS] = 1UL << (_node % BITS);
+      syscall(SYS_mbind, data, size, MPOL_PREFERRED_, mask, 1024, 0);
+    }
+  }
+#endif
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  zephyr::ByteBuffer::ByteBuffer() : ByteBuffer(Allocator::heap()) {
+  }
+
+  zephyr::ByteBuffer::ByteBuffer(Allocator &allocator) : _allocator(&allocator), _capacity(INITIAL_CAPACITY), _ownsData(true) {
+    _data = static_cast<uint8_t *>(allocator.allocate(INITIAL_CAPACITY));
+  }
+
+  zephyr::ByteBuffer::ByteBuffer(uint8_t *data, size_t size) : _allocator(&Allocator::heap()), _data(data), _size(size), _capacity(size) {
+  }
+
+  zephyr::ByteBuffer::ByteBuffer(const uint8_t *data, size_t size) : _allocator(&Allocator::heap()), _data(const_cast<uint8_t *>(data)), _size(size), _capacity(size), _isConst(true) {
+    (void)_isConst;
+  }
+
+  zephyr::ByteBuffer::~ByteBuffer() {
+    if (_ownsData) {
+      _allocator->deallocate(_data, _capacity);
+    }
+    delete [] _references;
+  }
+
+  void zephyr::ByteBuffer::_ensureCapacity(size_t capacity) {
+    if (capacity > _capacity) {
+      size_t newCapacity = capacity * GROWTH_FACTOR;
+      uint8_t *data = static_cast<uint8_t *>(_allocator->allocate(newCapacity));
+      memcpy(data, _data, _size);
+
+      if (_ownsData) {
+        _allocator->deallocate(_data, _capacity);
+      }
+
+      _data = data;
+      _capacity = newCapacity;
+      _ownsData = true;
+    }
+  }
+
+  void zephyr::ByteBuffer::_reference(const uint8_t *data, size_t length) {
+    if (_referenceCount == _referenceCapacity) {
+      size_t newCapacity = _referenceCapacity ? _referenceCapacity * GROWTH_FACTOR : 8;
+      Reference *references = new Reference[newCapacity];
+      for (size_t i = 0; i < _referenceCount; i++) {
+        references[i] = _references[i];
+      }
+      delete [] _references;
+      _references = references;
+      _referenceCapacity = newCapacity;
+    }
+
+    Reference &reference = _references[_referenceCount++];
+    reference.offset = _size;
+    reference.data = data;
+    reference.length = length;
+    _referencedSize += length;
+  }
+
+  size_t zephyr::ByteBuffer::segments(Segment *result, size_t count) const {
+    size_t total = 0;
+    size_t offset = 0;
+
+    for (size_t i = 0; i <= _referenceCount; i++) {
+      size_t end = i < _referenceCount ? _references[i].offset : _size;
+
+      // Inline bytes written since the previous reference
+      if (end > offset) {
+        if (total < count) {
+          result[total].iov_base = _data + offset;
+          result[total].iov_len = end - offset;
+        }
+        total++;
+      }
+
+      if (i < _referenceCount) {
+        if (total < count) {
+          result[total].iov_base = const_cast<uint8_t *>(_references[i].data);
+          result[total].iov_len = _references[i].length;
+        }
+        total++;
+      }
+
+      offset = end;
+    }
+
+    return total;
+  }
+
+  void zephyr::ByteBuffer::_growBy(size_t amount) {
+    assert(!_isConst);
+    _ensureCapacity(_size + amount);
+    _size += amount;
+  }
+
+  bool zephyr::ByteBuffer::readByte(bool &result) {
+    uint8_t value;
+    if (!readByte(value)) {
+      result = false;
+      return false;
+    }
+    result = value != 0;
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readByte(uint8_t &result) {
+    if (_index >= _size) {
+      result = 0;
+      return false;
+    }
+    result = _data[_index];
+    _index++;
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readVarFloat(float &result) {
+    uint8_t first;
+    if (!readByte(first)) {
+      return false;
+    }
+
+    if (first == 0) {
+      result = 0;
+      return true;
+    }
+
+    if (_index + 3 > _size) {
+      result = 0;
+      return false;
+    }
+    uint32_t bits = first | (_data[_index] << 8) | (_data[_index + 1] << 16) | (_data[_index + 2] << 24);
+    _index += 3;
+
+    bits = (bits << 23) | (bits >> 9);
+    memcpy(&result, &bits, 4);
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readVarFloat16(float &result) {
+    if (_index + 2 > _size) {
+      result = 0;
+      return false;
+    }
+
+    uint16_t half = _data[_index] | (_data[_index + 1] << 8);
+    _index += 2;
+
+    // Convert half-precision to single-precision
+    uint32_t sign = (half >> 15) & 0x1;
+    uint32_t exp = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+
+    if (exp == 0) {
+      if (mantissa == 0) {
+        result = sign ? -0.0f : 0.0f;
+      } else {
+        // Denormalized
+        uint32_t bits = (sign << 31) | ((exp + 112) << 23) | (mantissa << 13);
+        memcpy(&result, &bits, 4);
+      }
+    } else if (exp == 31) {
+      // Infinity or NaN
+      uint32_t bits = (sign << 31) | 0x7F800000 | (mantissa << 13);
+      memcpy(&result, &bits, 4);
+    } else {
+      uint32_t bits = (sign << 31) | ((exp + 112) << 23) | (mantissa << 13);
+      memcpy(&result, &bits, 4);
+    }
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readDouble(double &result) {
+    if (_index + 8 > _size) {
       result = 0;
       return false;
     }
@@ -400,6 +1403,27 @@ namespace zephyr {
     return true;
   }
 
+  bool zephyr::ByteBuffer::readStringInPlace(String &result, MemoryPool &pool) {
+    uint32_t length;
+    if (!readVarUint(length)) {
+      return false;
+    }
+    if (_index + length > _size) {
+      return false;
+    }
+    if (length >= result._storage) {
+      result = pool.string(reinterpret_cast<const char *>(_data + _index), length);
+    } else {
+      // The storage came from the pool, so it's writable
+      char *c_str = const_cast<char *>(result._c_str);
+      if (length) memcpy(c_str, _data + _index, length);
+      c_str[length] = '\0';
+      result._length = length;
+    }
+    _index += length;
+    return true;
+  }
+
   bool zephyr::ByteBuffer::readBytes(uint8_t *&result, size_t &length) {
     uint32_t len;
     if (!readVarUint(len)) {
@@ -414,10 +1438,63 @@ namespace zephyr {
     return true;
   }
 
-  bool zephyr::ByteBuffer::readVarUint64(uint64_t &result) {
-    uint8_t shift = 0;
-    uint8_t byte;
-    result = 0;
+  bool zephyr::ByteBuffer::readRawBytes(const uint8_t *&result, size_t length) {
+    if (length > _size - _index) {
+      return false;
+    }
+    result = _data + _index;
+    _index += length;
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readBytes(Array<uint8_t> &result, MemoryPool &pool) {
+    uint32_t length;
+    if (!readVarUint(length)) {
+      return false;
+    }
+    if (_index + length > _size) {
+      return false;
+    }
+    result = pool.array<uint8_t>(length);
+    memcpy(result.data(), _data + _index, length);
+    _index += length;
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readBytes(CompactArray<uint8_t> &result, MemoryPool &pool) {
+    uint32_t length;
+    if (!readVarUint(length)) {
+      return false;
+    }
+    if (_index + length > _size) {
+      return false;
+    }
+    uint8_t *data = pool.allocate<uint8_t>(length);
+    if (length) memcpy(data, _data + _index, length);
+    _index += length;
+    return result.assign(data, length);
+  }
+
+  bool zephyr::ByteBuffer::readBytesInPlace(Array<uint8_t> &result, MemoryPool &pool) {
+    uint32_t length;
+    if (!readVarUint(length)) {
+      return false;
+    }
+    if (_index + length > _size) {
+      return false;
+    }
+    if (!result.resize(length)) {
+      result = pool.array<uint8_t>(length);
+    }
+    if (length) memcpy(result.data(), _data + _index, length); // Empty arrays may have no data
+    _index += length;
+    return true;
+  }
+
+  bool zephyr::ByteBuffer::readVarUint64(uint64_t &result) {
+    uint8_t shift = 0;
+    uint8_t byte;
+    result = 0;
 
     while (true) {
       if (!readByte(byte)) {
@@ -582,6 +1659,10 @@ namespace zephyr {
   void zephyr::ByteBuffer::writeString(const char *value, size_t length) {
     assert(!_isConst);
     writeVarUint(length);
+    if (_gatherThreshold && length >= _gatherThreshold) {
+      _reference(reinterpret_cast<const uint8_t *>(value), length);
+      return;
+    }
     size_t index = _size;
     _growBy(length);
     memcpy(_data + index, value, length);
@@ -594,9 +1675,24 @@ namespace zephyr {
   void zephyr::ByteBuffer::writeBytes(const uint8_t *value, size_t length) {
     assert(!_isConst);
     writeVarUint(length);
+    if (_gatherThreshold && length >= _gatherThreshold) {
+      _reference(value, length);
+      return;
+    }
     size_t index = _size;
     _growBy(length);
-    memcpy(_data + index, value, length);
+    if (length) memcpy(_data + index, value, length); // Empty arrays may have no data
+  }
+
+  void zephyr::ByteBuffer::writeRawBytes(const uint8_t *value, size_t length) {
+    assert(!_isConst);
+    if (_gatherThreshold && length >= _gatherThreshold) {
+      _reference(value, length);
+      return;
+    }
+    size_t index = _size;
+    _growBy(length);
+    if (length) memcpy(_data + index, value, length); // Empty arrays may have no data
   }
 
   void zephyr::ByteBuffer::writeVarIntDelta(int32_t value, int32_t &last) {
@@ -624,43 +1720,98 @@ namespace zephyr {
   ////////////////////////////////////////////////////////////////////////////////
 
   void zephyr::MemoryPool::clear() {
+    Allocator &allocator = _allocator ? *_allocator : Allocator::heap();
     for (Chunk *chunk = _first, *next; chunk; chunk = next) {
       next = chunk->next;
-      delete [] chunk->data;
+      allocator.deallocate(chunk->data, chunk->capacity);
       delete chunk;
     }
     _first = _last = nullptr;
   }
 
-  template <typename T>
-  T *zephyr::MemoryPool::allocate(uint32_t count) {
+  uint8_t *zephyr::MemoryPool::_allocate(uint32_t size, uint32_t alignment) {
     Chunk *chunk = _last;
-    uint32_t size = count * sizeof(T);
-    uint32_t index = (chunk ? chunk->used : 0) + alignof(T) - 1;
-    index -= index % alignof(T);
+    uint32_t index = (chunk ? chunk->used : 0) + alignment - 1;
+    index -= index % alignment;
 
     if (chunk && index + size >= index && index + size <= chunk->capacity) {
       chunk->used = index + size;
-      return reinterpret_cast<T *>(chunk->data + index);
+      return chunk->data + index;
     }
 
+    // Chunks are not zeroed up front so untouched memory is never faulted in
+    Allocator &allocator = _allocator ? *_allocator : Allocator::heap();
+    size_t capacity = size > _chunkSize ? size : _chunkSize;
+    if (capacity < allocator.minimumSize()) capacity = allocator.minimumSize();
     chunk = new Chunk;
-    chunk->capacity = size > INITIAL_CAPACITY ? size : INITIAL_CAPACITY;
-    chunk->data = new uint8_t[chunk->capacity]();
+    chunk->capacity = static_cast<uint32_t>(capacity);
+    chunk->data = static_cast<uint8_t *>(allocator.allocate(chunk->capacity));
     chunk->used = size;
 
     if (_last) _last->next = chunk;
     else _first = chunk;
     _last = chunk;
 
-    return reinterpret_cast<T *>(chunk->data);
+    return chunk->data;
+  }
+
+  template <typename T>
+  T *zephyr::MemoryPool::allocate(uint32_t count) {
+    // Generated code relies on objects starting out zeroed
+    uint32_t size = count * sizeof(T);
+    uint8_t *data = _allocate(size, alignof(T));
+    memset(data, 0, size);
+    return reinterpret_cast<T *>(data);
   }
 
   zephyr::String zephyr::MemoryPool::string(const char *text, uint32_t count) {
-    char *c_str = allocate<char>(count + 1);
+    char *c_str = reinterpret_cast<char *>(_allocate(count + 1, 1));
     memcpy(c_str, text, count);
     c_str[count] = '\0';
-    return String(c_str, count);
+    return String(c_str, count, count + 1);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  void zephyr::UnknownFields::add(const uint8_t *data, size_t size, MemoryPool &pool) {
+    // Consecutive unknown fields usually sit next to each other
+    if (_last && _last->data + _last->size == data) {
+      _last->size += size;
+      return;
+    }
+
+    Range *range = pool.allocate<Range>();
+    range->data = data;
+    range->size = size;
+    range->next = nullptr;
+
+    if (_last) _last->next = range;
+    else _first = range;
+    _last = range;
+  }
+
+  void zephyr::UnknownFields::encode(ByteBuffer &bb) const {
+    for (Range *range = _first; range; range = range->next) {
+      bb.writeRawBytes(range->data, range->size);
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+
+  bool zephyr::PresenceBitmap::any(uint32_t first) const {
+    for (uint32_t id = first; id <= _count; id++) {
+      if (has(id)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool zephyr::PresenceBitmap::read(ByteBuffer &bb) {
+    if (!bb.readVarUint(_count)) {
+      return false;
+    }
+    return bb.readRawBytes(_bits, ((size_t)_count + 7) >> 3);
   }
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -675,9 +1826,9 @@ namespace zephyr {
       return false;
     }
 
-    _definitions = _pool.array<Definition>(definitionCount);
+    auto definitions = _pool.array<Definition>(definitionCount);
 
-    for (auto &definition : _definitions) {
+    for (auto &definition : definitions) {
       uint32_t fieldCount = 0;
 
       size_t nameLength;
@@ -689,10 +1840,11 @@ namespace zephyr {
         return false;
       }
 
+      auto fields = _pool.array<Field>(fieldCount);
       definition.name = _pool.string(namePtr, nameLength);
-      definition.fields = _pool.array<Field>(fieldCount);
+      definition.fields = Array<const Field>(fields.data(), fieldCount);
 
-      for (auto &field : definition.fields) {
+      for (auto &field : fields) {
         size_t fieldNameLength;
         const char *fieldNamePtr;
         if (!bb.readString(fieldNamePtr, fieldNameLength) ||
@@ -722,6 +1874,7 @@ namespace zephyr {
       }
     }
 
+    _definitions = Array<const Definition>(definitions.data(), definitionCount);
     return true;
   }
 
@@ -748,6 +1901,66 @@ namespace zephyr {
     return false;
   }
 
+  bool zephyr::BinarySchema::skipDenseFields(ByteBuffer &bb, uint32_t definition, const PresenceBitmap &bitmap, uint32_t first, uint32_t last) const {
+    if (last > bitmap.count()) {
+      last = bitmap.count() + 1;
+    }
+    for (uint32_t id = first; id < last; id++) {
+      if (bitmap.has(id) && !skipField(bb, definition, id)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool zephyr::BinarySchema::findField(ByteBuffer &bb, uint32_t definition, uint32_t field, size_t &start, size_t &end) const {
+    bool found = false;
+
+    while (true) {
+      size_t offset = bb.index();
+      uint32_t id;
+
+      if (!bb.readVarUint(id)) {
+        return false;
+      }
+
+      if (!id) {
+        if (!found) {
+          start = end = offset;
+        }
+        return true;
+      }
+
+      if (!skipField(bb, definition, id)) {
+        return false;
+      }
+
+      // Decoding keeps the last occurrence, so that's the one to patch
+      if (id == field) {
+        start = offset;
+        end = bb.index();
+        found = true;
+      }
+    }
+  }
+
+  bool zephyr::BinarySchema::patchField(const uint8_t *data, size_t size, uint32_t definition, uint32_t field,
+      const uint8_t *value, size_t length, ByteBuffer &out) const {
+    ByteBuffer bb(data, size);
+    size_t start = 0;
+    size_t end = 0;
+
+    if (!findField(bb, definition, field, start, end)) {
+      return false;
+    }
+
+    out.writeRawBytes(data, start);
+    out.writeVarUint(field);
+    out.writeRawBytes(value, length);
+    out.writeRawBytes(data + end, size - end);
+    return true;
+  }
+
   bool zephyr::BinarySchema::_skipField(ByteBuffer &bb, const Field &field) const {
     uint32_t count = 1;
 
@@ -877,6 +2090,952 @@ namespace zephyr {
     return true;
   }
 
+  ////////////////////////////////////////////////////////////////////////////////
+
+  bool zephyr::JsonTranscoder::toJson(ByteBuffer &bb, uint32_t definition, ByteBuffer &out) const {
+    if (definition >= _schema.definitions().size()) {
+      return false;
+    }
+    return _toJsonValue(bb, definition, out, 0);
+  }
+
+  bool zephyr::JsonTranscoder::_toJsonDefinition(ByteBuffer &bb, uint32_t definition, ByteBuffer &out, uint32_t depth) const {
+    const Definition &item = _schema.definitions()[definition];
+    bool isFirst = true;
+
+    if (depth > MAX_DEPTH) {
+      return false;
+    }
+
+    out.writeByte('{');
+
+    if (item.kind == BinarySchema::KIND_STRUCT) {
+      for (auto &field : item.fields) {
+        if (!isFirst) out.writeByte(',');
+        isFirst = false;
+        _writeString(out, field.name.c_str(), field.name.length());
+        out.writeByte(':');
+        if (!_toJsonField(bb, field, out, depth)) return false;
+      }
+    } else {
+      while (true) {
+        uint32_t id;
+        if (!bb.readVarUint(id)) return false;
+        if (!id) break;
+        const Field *field = _findField(item, id);
+        if (!field) return false;
+        if (!isFirst) out.writeByte(',');
+        isFirst = false;
+        _writeString(out, field->name.c_str(), field->name.length());
+        out.writeByte(':');
+        if (!_toJsonField(bb, *field, out, depth)) return false;
+      }
+    }
+
+    out.writeByte('}');
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_toJsonField(ByteBuffer &bb, const Field &field, ByteBuffer &out, uint32_t depth) const {
+    uint32_t count = field.arraySize;
+
+    if (field.isMap) {
+      if (!bb.readVarUint(count)) return false;
+      out.writeByte('{');
+      for (uint32_t i = 0; i < count; i++) {
+        if (i) out.writeByte(',');
+        if (!_toJsonKey(bb, field.keyType, out)) return false;
+        out.writeByte(':');
+        if (!_toJsonValue(bb, field.type, out, depth)) return false;
+      }
+      out.writeByte('}');
+      return true;
+    }
+
+    if (!field.isArray && !field.isFixedArray) {
+      return _toJsonValue(bb, field.type, out, depth);
+    }
+
+    if (!field.isFixedArray && !bb.readVarUint(count)) {
+      return false;
+    }
+
+    out.writeByte('[');
+    for (uint32_t i = 0; i < count; i++) {
+      if (i) out.writeByte(',');
+      if (!_toJsonValue(bb, field.type, out, depth)) return false;
+    }
+    out.writeByte(']');
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_toJsonValue(ByteBuffer &bb, int32_t type, ByteBuffer &out, uint32_t depth) const {
+    switch (type) {
+      case BinarySchema::TYPE_BOOL: {
+        uint8_t value;
+        if (!bb.readByte(value)) return false;
+        if (value) _write(out, "true", 4);
+        else _write(out, "false", 5);
+        break;
+      }
+
+      case BinarySchema::TYPE_BYTE: {
+        uint8_t value;
+        if (!bb.readByte(value)) return false;
+        _writeUint64(out, value);
+        break;
+      }
+
+      case BinarySchema::TYPE_INT: {
+        int32_t value;
+        if (!bb.readVarInt(value)) return false;
+        _writeInt64(out, value);
+        break;
+      }
+
+      case BinarySchema::TYPE_UINT: {
+        uint32_t value;
+        if (!bb.readVarUint(value)) return false;
+        _writeUint64(out, value);
+        break;
+      }
+
+      case BinarySchema::TYPE_FLOAT: {
+        float value;
+        if (!bb.readVarFloat(value)) return false;
+        _writeFloat(out, value, true);
+        break;
+      }
+
+      case BinarySchema::TYPE_FLOAT16: {
+        float value;
+        if (!bb.readVarFloat16(value)) return false;
+        _writeFloat(out, value, true);
+        break;
+      }
+
+      case BinarySchema::TYPE_DOUBLE: {
+        double value;
+        if (!bb.readDouble(value)) return false;
+        _writeFloat(out, value, false);
+        break;
+      }
+
+      case BinarySchema::TYPE_STRING: {
+        const char *data;
+        size_t length;
+        if (!bb.readString(data, length)) return false;
+        _writeString(out, data, length);
+        break;
+      }
+
+      case BinarySchema::TYPE_BYTES: {
+        uint8_t *data;
+        size_t length;
+        if (!bb.readBytes(data, length)) return false;
+        out.writeByte('[');
+        for (size_t i = 0; i < length; i++) {
+          if (i) out.writeByte(',');
+          _writeUint64(out, data[i]);
+        }
+        out.writeByte(']');
+        break;
+      }
+
+      case BinarySchema::TYPE_INT64: {
+        int64_t value;
+        if (!bb.readVarInt64(value)) return false;
+        out.writeByte('"');
+        _writeInt64(out, value);
+        out.writeByte('"');
+        break;
+      }
+
+      case BinarySchema::TYPE_UINT64: {
+        uint64_t value;
+        if (!bb.readVarUint64(value)) return false;
+        out.writeByte('"');
+        _writeUint64(out, value);
+        out.writeByte('"');
+        break;
+      }
+
+      default: {
+        if (type < 0 || (uint32_t)type >= _schema.definitions().size()) {
+          return false;
+        }
+
+        const Definition &definition = _schema.definitions()[type];
+
+        if (definition.kind != BinarySchema::KIND_ENUM) {
+          return _toJsonDefinition(bb, type, out, depth + 1);
+        }
+
+        // Values without a name are kept as numbers
+        uint32_t value;
+        if (!bb.readVarUint(value)) return false;
+        const Field *field = _findField(definition, value);
+        if (field) _writeString(out, field->name.c_str(), field->name.length());
+        else _writeUint64(out, value);
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_toJsonKey(ByteBuffer &bb, int32_t type, ByteBuffer &out) const {
+    if (type == BinarySchema::TYPE_STRING || type == BinarySchema::TYPE_INT64 || type == BinarySchema::TYPE_UINT64) {
+      return _toJsonValue(bb, type, out, 0);
+    }
+
+    if (type >= 0 && (uint32_t)type < _schema.definitions().size() && _schema.definitions()[type].kind == BinarySchema::KIND_ENUM) {
+      uint32_t value;
+      if (!bb.readVarUint(value)) return false;
+      const Field *field = _findField(_schema.definitions()[type], value);
+      if (field) {
+        _writeString(out, field->name.c_str(), field->name.length());
+        return true;
+      }
+      out.writeByte('"');
+      _writeUint64(out, value);
+      out.writeByte('"');
+      return true;
+    }
+
+    out.writeByte('"');
+    if (!_toJsonValue(bb, type, out, 0)) return false;
+    out.writeByte('"');
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::fromJson(const char *json, size_t length, uint32_t definition, ByteBuffer &out) const {
+    MemoryPool scratch;
+    Input in;
+
+    if (definition >= _schema.definitions().size()) {
+      return false;
+    }
+
+    in.data = json;
+    in.end = json + length;
+    in.scratch = &scratch;
+
+    if (!_fromJsonValue(in, definition, out, 0)) {
+      return false;
+    }
+
+    _skipSpace(in);
+    return in.data == in.end;
+  }
+
+  bool zephyr::JsonTranscoder::_fromJsonDefinition(Input &in, uint32_t definition, ByteBuffer &out, uint32_t depth) const {
+    const Definition &item = _schema.definitions()[definition];
+    bool isStruct = item.kind == BinarySchema::KIND_STRUCT;
+    const char **pending = nullptr; // Where struct fields that came early start
+    uint32_t next = 0; // The next struct field to write
+    uint32_t hint = 0;
+
+    if (depth > MAX_DEPTH || !_expect(in, '{')) {
+      return false;
+    }
+
+    if (!_expect(in, '}')) {
+      do {
+        const char *name;
+        size_t length;
+        bool isEscaped;
+        if (!_readRawString(in, name, length, isEscaped) || !_expect(in, ':')) return false;
+
+        // Field names never need escapes
+        const Field *field = isEscaped ? nullptr : _findField(item, name, length, hint);
+
+        if (!field) {
+          if (!_skipValue(in)) return false;
+          continue;
+        }
+
+        uint32_t index = field - item.fields.begin();
+        hint = index + 1;
+
+        if (!isStruct) {
+          if (_expectLiteral(in, "null", 4)) continue;
+          out.writeVarUint(field->value);
+          if (!_fromJsonField(in, *field, out, depth)) return false;
+        }
+
+        // Struct fields have no ids, so they have to be written in order
+        else if (index == next) {
+          if (!_fromJsonField(in, *field, out, depth)) return false;
+          for (next++; pending && next < item.fields.size() && pending[next]; next++) {
+            Input early = in;
+            early.data = pending[next];
+            if (!_fromJsonField(early, item.fields[next], out, depth)) return false;
+          }
+        } else if (index > next && !(pending && pending[index])) {
+          if (!pending) pending = in.scratch->allocate<const char *>(item.fields.size());
+          _skipSpace(in);
+          pending[index] = in.data;
+          if (!_skipValue(in)) return false;
+        } else {
+          return false;
+        }
+      } while (_expect(in, ','));
+
+      if (!_expect(in, '}')) {
+        return false;
+      }
+    }
+
+    if (isStruct) {
+      return next == item.fields.size();
+    }
+
+    out.writeVarUint(0);
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_fromJsonField(Input &in, const Field &field, ByteBuffer &out, uint32_t depth) const {
+    uint32_t count = 0;
+    size_t start = 0;
+
+    if (field.isMap) {
+      if (!_expect(in, '{')) return false;
+      start = _beginCount(out);
+      if (!_expect(in, '}')) {
+        do {
+          if (!_fromJsonKey(in, field.keyType, out) || !_expect(in, ':')) return false;
+          if (!_fromJsonValue(in, field.type, out, depth)) return false;
+          count++;
+        } while (_expect(in, ','));
+        if (!_expect(in, '}')) return false;
+      }
+      _endCount(out, start, count);
+      return true;
+    }
+
+    if (!field.isArray && !field.isFixedArray) {
+      return _fromJsonValue(in, field.type, out, depth);
+    }
+
+    if (!_expect(in, '[')) {
+      return false;
+    }
+
+    if (!field.isFixedArray) {
+      start = _beginCount(out);
+    }
+
+    if (!_expect(in, ']')) {
+      do {
+        if (!_fromJsonValue(in, field.type, out, depth)) return false;
+        count++;
+      } while (_expect(in, ','));
+      if (!_expect(in, ']')) return false;
+    }
+
+    if (field.isFixedArray) {
+      return count == field.arraySize;
+    }
+
+    _endCount(out, start, count);
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_fromJsonValue(Input &in, int32_t type, ByteBuffer &out, uint32_t depth) const {
+    bool isNegative = false;
+    uint64_t magnitude = 0;
+    double value = 0;
+
+    switch (type) {
+      case BinarySchema::TYPE_BOOL: {
+        if (_expectLiteral(in, "true", 4)) out.writeByte(1);
+        else if (_expectLiteral(in, "false", 5)) out.writeByte(0);
+        else return false;
+        break;
+      }
+
+      case BinarySchema::TYPE_BYTE: {
+        if (!_readInteger(in, isNegative, magnitude) || (isNegative && magnitude) || magnitude > 0xFF) return false;
+        out.writeByte((uint8_t)magnitude);
+        break;
+      }
+
+      case BinarySchema::TYPE_INT: {
+        if (!_readInteger(in, isNegative, magnitude) || magnitude > (isNegative ? 0x80000000ULL : 0x7FFFFFFFULL)) return false;
+        out.writeVarInt((int32_t)(isNegative ? 0 - (uint32_t)magnitude : (uint32_t)magnitude));
+        break;
+      }
+
+      case BinarySchema::TYPE_UINT: {
+        if (!_readInteger(in, isNegative, magnitude) || (isNegative && magnitude) || magnitude > 0xFFFFFFFFULL) return false;
+        out.writeVarUint((uint32_t)magnitude);
+        break;
+      }
+
+      case BinarySchema::TYPE_FLOAT: {
+        if (!_readFloat(in, value)) return false;
+        out.writeVarFloat((float)value);
+        break;
+      }
+
+      case BinarySchema::TYPE_FLOAT16: {
+        if (!_readFloat(in, value)) return false;
+        out.writeVarFloat16((float)value);
+        break;
+      }
+
+      case BinarySchema::TYPE_DOUBLE: {
+        if (!_readFloat(in, value)) return false;
+        out.writeDouble(value);
+        break;
+      }
+
+      case BinarySchema::TYPE_STRING: {
+        return _readString(in, out);
+      }
+
+      case BinarySchema::TYPE_BYTES: {
+        uint32_t count = 0;
+        if (!_expect(in, '[')) return false;
+        size_t start = _beginCount(out);
+        if (!_expect(in, ']')) {
+          do {
+            if (!_readInteger(in, isNegative, magnitude) || (isNegative && magnitude) || magnitude > 0xFF) return false;
+            out.writeByte((uint8_t)magnitude);
+            count++;
+          } while (_expect(in, ','));
+          if (!_expect(in, ']')) return false;
+        }
+        _endCount(out, start, count);
+        break;
+      }
+
+      // Written as strings but also accepted as numbers
+      case BinarySchema::TYPE_INT64:
+      case BinarySchema::TYPE_UINT64: {
+        bool isQuoted = _expect(in, '"');
+        if (!_readInteger(in, isNegative, magnitude)) return false;
+        if (isQuoted && (in.data == in.end || *in.data++ != '"')) return false;
+        if (type == BinarySchema::TYPE_UINT64) {
+          if (isNegative && magnitude) return false;
+          out.writeVarUint64(magnitude);
+        } else {
+          if (magnitude > (isNegative ? 0x8000000000000000ULL : 0x7FFFFFFFFFFFFFFFULL)) return false;
+          out.writeVarInt64((int64_t)(isNegative ? 0 - magnitude : magnitude));
+        }
+        break;
+      }
+
+      default: {
+        if (type < 0 || (uint32_t)type >= _schema.definitions().size()) {
+          return false;
+        }
+
+        const Definition &definition = _schema.definitions()[type];
+
+        if (definition.kind != BinarySchema::KIND_ENUM) {
+          return _fromJsonDefinition(in, type, out, depth + 1);
+        }
+
+        // Either a member name or a number
+        _skipSpace(in);
+        if (in.data != in.end && *in.data == '"') {
+          const char *name;
+          size_t length;
+          bool isEscaped;
+          if (!_readRawString(in, name, length, isEscaped) || isEscaped) return false;
+          const Field *field = _findField(definition, name, length, 0);
+          if (!field) return false;
+          out.writeVarUint(field->value);
+        } else {
+          if (!_readInteger(in, isNegative, magnitude) || (isNegative && magnitude) || magnitude > 0xFFFFFFFFULL) return false;
+          out.writeVarUint((uint32_t)magnitude);
+        }
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_fromJsonKey(Input &in, int32_t type, ByteBuffer &out) const {
+    if (type == BinarySchema::TYPE_STRING || type == BinarySchema::TYPE_INT64 || type == BinarySchema::TYPE_UINT64) {
+      return _fromJsonValue(in, type, out, 0);
+    }
+
+    // Other keys are parsed from the contents of the string
+    const char *data;
+    size_t length;
+    bool isEscaped;
+    if (!_readRawString(in, data, length, isEscaped) || isEscaped) {
+      return false;
+    }
+
+    if (type >= 0 && (uint32_t)type < _schema.definitions().size() && _schema.definitions()[type].kind == BinarySchema::KIND_ENUM) {
+      const Field *field = _findField(_schema.definitions()[type], data, length, 0);
+      if (field) {
+        out.writeVarUint(field->value);
+        return true;
+      }
+    }
+
+    Input key;
+    key.data = data;
+    key.end = data + length;
+    key.scratch = in.scratch;
+    if (!_fromJsonValue(key, type, out, 0)) {
+      return false;
+    }
+    _skipSpace(key);
+    return key.data == key.end;
+  }
+
+  const zephyr::BinarySchema::Field *zephyr::JsonTranscoder::_findField(const Definition &definition, uint32_t id) const {
+    // Message ids usually match their position
+    if (id - 1 < definition.fields.size() && definition.fields[id - 1].value == id) {
+      return &definition.fields[id - 1];
+    }
+    for (auto &field : definition.fields) {
+      if (field.value == id) {
+        return &field;
+      }
+    }
+    return nullptr;
+  }
+
+  const zephyr::BinarySchema::Field *zephyr::JsonTranscoder::_findField(const Definition &definition, const char *name, size_t length, uint32_t hint) const {
+    uint32_t count = definition.fields.size();
+
+    // Start after the previous field, since keys are usually in order
+    for (uint32_t i = 0, index = hint; i < count; i++, index++) {
+      if (index >= count) index -= count;
+      const Field &field = definition.fields[index];
+      if (field.name.length() == length && !memcmp(field.name.c_str(), name, length)) {
+        return &field;
+      }
+    }
+    return nullptr;
+  }
+
+  void zephyr::JsonTranscoder::_write(ByteBuffer &out, const char *data, size_t length) {
+    // Always copies, unlike writeRawBytes() with a gather threshold
+    size_t index = out._size;
+    out._growBy(length);
+    memcpy(out._data + index, data, length);
+  }
+
+  void zephyr::JsonTranscoder::_writeUint64(ByteBuffer &out, uint64_t value) {
+    static const char digits[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+    char buffer[20];
+    char *end = buffer + sizeof(buffer);
+    char *start = end;
+
+    // Two digits at a time from the end
+    while (value >= 100) {
+      uint32_t index = (uint32_t)(value % 100) * 2;
+      value /= 100;
+      *--start = digits[index + 1];
+      *--start = digits[index];
+    }
+    if (value >= 10) {
+      uint32_t index = (uint32_t)value * 2;
+      *--start = digits[index + 1];
+      *--start = digits[index];
+    } else {
+      *--start = (char)('0' + value);
+    }
+
+    _write(out, start, end - start);
+  }
+
+  void zephyr::JsonTranscoder::_writeInt64(ByteBuffer &out, int64_t value) {
+    if (value < 0) {
+      out.writeByte('-');
+      _writeUint64(out, 0 - (uint64_t)value);
+    } else {
+      _writeUint64(out, value);
+    }
+  }
+
+  void zephyr::JsonTranscoder::_writeFloat(ByteBuffer &out, double value, bool isSingle) {
+    char buffer[32];
+
+    // JSON has no infinity or NaN
+    if (!(value - value == 0)) {
+      _write(out, "null", 4);
+      return;
+    }
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    // Shortest representation that reads back to the same value
+    std::to_chars_result result = isSingle
+      ? std::to_chars(buffer, buffer + sizeof(buffer), (float)value)
+      : std::to_chars(buffer, buffer + sizeof(buffer), value);
+    _write(out, buffer, result.ptr - buffer);
+#else
+    // snprintf() writes the decimal point of the current locale, which JSON
+    // doesn't allow to be anything but "."
+    int length = snprintf(buffer, sizeof(buffer), isSingle ? "%.9g" : "%.17g", value);
+    const char *point = localeconv()->decimal_point;
+    size_t pointLength = strlen(point);
+    char *found = pointLength && strcmp(point, ".") ? strstr(buffer, point) : nullptr;
+    if (found) {
+      *found = '.';
+      memmove(found + 1, found + pointLength, buffer + length + 1 - (found + pointLength));
+      length -= (int)pointLength - 1;
+    }
+    _write(out, buffer, length);
+#endif
+  }
+
+  void zephyr::JsonTranscoder::_writeString(ByteBuffer &out, const char *data, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    out.writeByte('"');
+
+    // Copy runs of characters that don't need escaping in one go
+    for (size_t i = 0; i < length; i++) {
+      uint8_t c = data[i];
+      if (c >= 0x20 && c != '"' && c != '\\') continue;
+      _write(out, data + start, i - start);
+      start = i + 1;
+
+      switch (c) {
+        case '"': _write(out, "\\\"", 2); break;
+        case '\\': _write(out, "\\\\", 2); break;
+        case '\b': _write(out, "\\b", 2); break;
+        case '\f': _write(out, "\\f", 2); break;
+        case '\n': _write(out, "\\n", 2); break;
+        case '\r': _write(out, "\\r", 2); break;
+        case '\t': _write(out, "\\t", 2); break;
+        default: {
+          char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+          _write(out, escape, sizeof(escape));
+          break;
+        }
+      }
+    }
+
+    _write(out, data + start, length - start);
+    out.writeByte('"');
+  }
+
+  size_t zephyr::JsonTranscoder::_beginCount(ByteBuffer &out) {
+    // Counts are only known at the end, so the largest varint is reserved
+    // and whatever follows is moved down once it's written
+    size_t start = out._size;
+    out._growBy(5);
+    return start;
+  }
+
+  void zephyr::JsonTranscoder::_endCount(ByteBuffer &out, size_t start, uint32_t count) {
+    uint8_t bytes[5];
+    size_t length = 0;
+
+    do {
+      uint8_t byte = count & 127;
+      count >>= 7;
+      bytes[length++] = count ? byte | 128 : byte;
+    } while (count);
+
+    memmove(out._data + start + length, out._data + start + 5, out._size - start - 5);
+    memcpy(out._data + start, bytes, length);
+    out._size -= 5 - length;
+  }
+
+  void zephyr::JsonTranscoder::_skipSpace(Input &in) {
+    while (in.data != in.end && (*in.data == ' ' || *in.data == '\n' || *in.data == '\r' || *in.data == '\t')) {
+      in.data++;
+    }
+  }
+
+  bool zephyr::JsonTranscoder::_expect(Input &in, char c) {
+    _skipSpace(in);
+    if (in.data == in.end || *in.data != c) {
+      return false;
+    }
+    in.data++;
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_expectLiteral(Input &in, const char *literal, size_t length) {
+    _skipSpace(in);
+    if ((size_t)(in.end - in.data) < length || memcmp(in.data, literal, length)) {
+      return false;
+    }
+    in.data += length;
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_readRawString(Input &in, const char *&data, size_t &length, bool &isEscaped) {
+    if (!_expect(in, '"')) {
+      return false;
+    }
+
+    const char *end = in.data;
+    isEscaped = false;
+
+    while (true) {
+      if (end == in.end) return false;
+      uint8_t c = *end;
+      if (c == '"') break;
+      if (c < 0x20) return false;
+      if (c == '\\') {
+        if (in.end - end < 2) return false;
+        isEscaped = true;
+        end += 2;
+      } else {
+        end++;
+      }
+    }
+
+    data = in.data;
+    length = end - in.data;
+    in.data = end + 1;
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_readHex(const char *data, uint32_t &result) {
+    result = 0;
+    for (int i = 0; i < 4; i++) {
+      char digit = data[i];
+      result <<= 4;
+      if (digit >= '0' && digit <= '9') result |= digit - '0';
+      else if (digit >= 'a' && digit <= 'f') result |= digit - 'a' + 10;
+      else if (digit >= 'A' && digit <= 'F') result |= digit - 'A' + 10;
+      else return false;
+    }
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_readString(Input &in, ByteBuffer &out) {
+    const char *data;
+    size_t length;
+    bool isEscaped;
+
+    if (!_readRawString(in, data, length, isEscaped)) {
+      return false;
+    }
+
+    if (!isEscaped) {
+      out.writeVarUint(length);
+      _write(out, data, length);
+      return true;
+    }
+
+    // Unescaping never makes the text longer
+    size_t start = _beginCount(out);
+    size_t index = out._size;
+    out._growBy(length);
+    uint8_t *result = out._data + index;
+    const char *end = data + length;
+
+    while (data != end) {
+      if (*data != '\\') {
+        *result++ = *data++;
+        continue;
+      }
+
+      char c = data[1];
+      data += 2;
+
+      switch (c) {
+        case '"': case '\\': case '/': *result++ = c; break;
+        case 'b': *result++ = '\b'; break;
+        case 'f': *result++ = '\f'; break;
+        case 'n': *result++ = '\n'; break;
+        case 'r': *result++ = '\r'; break;
+        case 't': *result++ = '\t'; break;
+
+        case 'u': {
+          uint32_t codePoint;
+          uint32_t low;
+          if (end - data < 4 || !_readHex(data, codePoint)) return false;
+          data += 4;
+
+          // A high surrogate combines with an immediately following low one.
+          // Unpaired surrogates can't be encoded in UTF-8 and become U+FFFD,
+          // like they do with TextEncoder in JavaScript.
+          if (codePoint >= 0xD800 && codePoint <= 0xDBFF && end - data >= 6 && data[0] == '\\' && data[1] == 'u' &&
+              _readHex(data + 2, low) && low >= 0xDC00 && low <= 0xDFFF) {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+            data += 6;
+          } else if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+            codePoint = 0xFFFD;
+          }
+
+          if (codePoint < 0x80) {
+            *result++ = codePoint;
+          } else if (codePoint < 0x800) {
+            *result++ = 0xC0 | (codePoint >> 6);
+            *result++ = 0x80 | (codePoint & 63);
+          } else if (codePoint < 0x10000) {
+            *result++ = 0xE0 | (codePoint >> 12);
+            *result++ = 0x80 | ((codePoint >> 6) & 63);
+            *result++ = 0x80 | (codePoint & 63);
+          } else {
+            *result++ = 0xF0 | (codePoint >> 18);
+            *result++ = 0x80 | ((codePoint >> 12) & 63);
+            *result++ = 0x80 | ((codePoint >> 6) & 63);
+            *result++ = 0x80 | (codePoint & 63);
+          }
+          break;
+        }
+
+        default: {
+          return false;
+        }
+      }
+    }
+
+    out._size = result - out._data;
+    _endCount(out, start, out._size - start - 5);
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_readInteger(Input &in, bool &isNegative, uint64_t &magnitude) {
+    _skipSpace(in);
+
+    const char *end = in.data;
+    uint64_t value = 0;
+
+    isNegative = end != in.end && *end == '-';
+    if (isNegative) end++;
+    if (end == in.end || *end < '0' || *end > '9') return false;
+
+    while (end != in.end && *end >= '0' && *end <= '9') {
+      uint64_t digit = *end++ - '0';
+      if (value > (UINT64_MAX - digit) / 10) return false;
+      value = value * 10 + digit;
+    }
+
+    // Fractions and exponents don't fit in integer fields
+    if (end != in.end && (*end == '.' || *end == 'e' || *end == 'E')) {
+      return false;
+    }
+
+    magnitude = value;
+    in.data = end;
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_readFloat(Input &in, double &result) {
+    // Non-finite values are written as null
+    if (_expectLiteral(in, "null", 4)) {
+      result = NAN;
+      return true;
+    }
+
+    const char *end = in.data;
+    while (end != in.end && ((*end >= '0' && *end <= '9') || *end == '-' || *end == '+' || *end == '.' || *end == 'e' || *end == 'E')) {
+      end++;
+    }
+    if (end == in.data) {
+      return false;
+    }
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    std::from_chars_result parsed = std::from_chars(in.data, end, result);
+    if (parsed.ec != std::errc() || parsed.ptr != end) return false;
+#else
+    // strtod() needs a terminator, which the input may not have, and
+    // expects the decimal point of the current locale instead of "."
+    char buffer[64];
+    char *parsed;
+    const char *point = localeconv()->decimal_point;
+    size_t pointLength = strlen(point);
+    size_t length = 0;
+    for (const char *data = in.data; data != end; data++) {
+      if (length + pointLength >= sizeof(buffer)) return false;
+      if (*data == '.' && pointLength) {
+        memcpy(buffer + length, point, pointLength);
+        length += pointLength;
+      } else {
+        buffer[length++] = *data;
+      }
+    }
+    buffer[length] = '\0';
+    result = strtod(buffer, &parsed);
+    if (parsed != buffer + length) return false;
+#endif
+
+    in.data = end;
+    return true;
+  }
+
+  bool zephyr::JsonTranscoder::_skipValue(Input &in) {
+    // Only checks the structure, since skipped values are never converted.
+    // Bit "depth" says whether that level is an object.
+    uint8_t isObject[MAX_DEPTH / 8] = {};
+    uint32_t depth = 0;
+    const char *data;
+    size_t length;
+    bool isEscaped;
+
+    while (true) {
+      _skipSpace(in);
+      if (in.data == in.end) return false;
+      char c = *in.data;
+
+      if (c == '"') {
+        if (!_readRawString(in, data, length, isEscaped)) return false;
+      } else if (c == '{' || c == '[') {
+        if (depth == MAX_DEPTH) return false;
+        in.data++;
+        _skipSpace(in);
+
+        if (in.data != in.end && *in.data == (c == '{' ? '}' : ']')) {
+          in.data++;
+        } else {
+          if (c == '{') {
+            isObject[depth >> 3] |= 1 << (depth & 7);
+            if (!_readRawString(in, data, length, isEscaped) || !_expect(in, ':')) return false;
+          } else {
+            isObject[depth >> 3] &= ~(1 << (depth & 7));
+          }
+          depth++;
+          continue;
+        }
+      } else {
+        const char *end = in.data;
+        while (end != in.end && ((*end >= '0' && *end <= '9') || (*end >= 'a' && *end <= 'z') || *end == '-' || *end == '+' || *end == '.' || *end == 'E')) {
+          end++;
+        }
+        if (end == in.data) return false;
+        in.data = end;
+      }
+
+      // After a value, either another one follows or its containers close
+      while (true) {
+        if (!depth) return true;
+        bool object = isObject[(depth - 1) >> 3] >> ((depth - 1) & 7) & 1;
+        _skipSpace(in);
+        if (in.data == in.end) return false;
+
+        if (*in.data == ',') {
+          in.data++;
+          if (object && (!_readRawString(in, data, length, isEscaped) || !_expect(in, ':'))) return false;
+          break;
+        }
+        if (*in.data != (object ? '}' : ']')) return false;
+        in.data++;
+        depth--;
+      }
+    }
+  }
+
 #endif
 #endif
 